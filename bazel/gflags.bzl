@@ -84,6 +84,7 @@ def gflags_library(hdrs = [], srcs = [], threads = 1):
         ],
         "//conditions:default": [
             "-DHAVE_UNISTD_H",
+            "-DHAVE_SYS_MMAN_H",
             "-DHAVE_FNMATCH_H",
             "-DHAVE_PTHREAD",
         ],
@@ -99,12 +99,29 @@
 #  define NO_SHLWAPI_ISOS
 #  include <shlwapi.h>
 #endif
+#if defined(HAVE_PTHREAD) && !defined(NO_THREADS) && !defined(OS_WINDOWS)
+#  include <pthread.h>
+#endif
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_UNISTD_H)
+#  define HAVE_MMAP_FLAGFILES
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#  ifndef O_CLOEXEC
+#    define O_CLOEXEC 0    // older systems; we don't exec() ourselves
+#  endif
+#endif
 #include <cstdarg> // For va_list and related operations
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 
 #include <algorithm>
+#include <functional>
 #include <map>
+#include <new>         // for placement new
+#include <set>
 #include <string>
 #include <utility>     // for pair<>
 #include <vector>
@@ -112,6 +129,16 @@
 #include "mutex.h"
 #include "util.h"
 
+// The environment, which we scan for --fromenv and --tryfromenv.
+#if defined(__APPLE__)
+#  include <crt_externs.h>
+#  define environ (*_NSGetEnviron())   // environ isn't there for dylibs
+#elif defined(OS_WINDOWS)
+#  define environ _environ
+#else
+extern char** environ;   // <unistd.h> declares it only for _GNU_SOURCE
+#endif
+
 using namespace MUTEX_NAMESPACE;
 
 
@@ -131,6 +158,7 @@ namespace GFLAGS_NAMESPACE {
 
 using std::map;
 using std::pair;
+using std::set;
 using std::sort;
 using std::string;
 using std::vector;
@@ -159,6 +187,18 @@ static bool allow_command_line_reparsing = false;
 
 static bool logging_is_probably_set_up = false;
 
+// Whether to read all flagfiles before applying any of them.
+static bool prefetch_flagfiles = false;
+
+// Whether to set each flag only once, to the last value assigned to it.
+static bool deduplicate_flag_assignments = false;
+// How many assignments that deduplication has skipped.  Protected by the
+// lock of the global registry.
+static uint64 num_skipped_flag_assignments = 0;
+
+// Whether to run the validators of unmodified flags on several threads.
+static bool validate_flags_in_parallel = false;
+
 // This is a 'prototype' validate-function.  'Real' validate
 // functions, take a flag-value as an argument: ValidateFn(bool) or
 // ValidateFn(uint64).  However, for easier storage, we strip off this
@@ -207,16 +247,23 @@ class FlagValue {
 
   bool ParseFrom(const char* spec);
   string ToString() const;
+  // Like ToString(), but appends to output instead of returning a new string.
+  void AppendTo(string* output) const;
 
   ValueType Type() const { return static_cast<ValueType>(type_); }
 
  private:
   friend class CommandLineFlag;  // for many things, including Validate()
-  friend class GFLAGS_NAMESPACE::FlagSaverImpl;  // calls New()
-  friend class FlagRegistry;     // checks value_buffer_ for flags_by_ptr_ map
+  friend class GFLAGS_NAMESPACE::FlagSaverImpl;  // saves and restores us
+  friend class GFLAGS_NAMESPACE::FlagHandle;     // gets and sets us
+  friend class FlagRegistry;     // checks value_buffer_ for flags_by_ptr_ index
+  friend class CommandLineFlagParser;  // validates copies without the lock
   template <typename T> friend T GetFromEnv(const char*, T);
-  friend bool TryParseLocked(const CommandLineFlag*, FlagValue*,
-                             const char*, string*);  // for New(), CopyFrom()
+  template <typename T> friend bool TryParseAsLocked(
+      const CommandLineFlag*, FlagValue*, const char*,
+      string*, string*);                                 // for MoveFrom()
+  friend bool TrySetLocked(const CommandLineFlag*, FlagValue*,
+                           const FlagValue&, string*, string*);  // for CopyFrom()
 
   template <typename FlagType>
   struct FlagValueTraits;
@@ -225,6 +272,11 @@ class FlagValue {
   bool Equal(const FlagValue& x) const;
   FlagValue* New() const;   // creates a new one with default value
   void CopyFrom(const FlagValue& x);
+  // Like CopyFrom(), but may leave x with any value, which saves copying
+  // the value of a string.
+  void MoveFrom(FlagValue* x);
+  // Exchanges our value with that of x, which must be of our type.
+  void SwapWith(FlagValue* x);
 
   // Calls the given validate-fn on value_buffer_, and returns
   // whatever it returns.  But first casts validate_fn_proto to a
@@ -310,53 +362,49 @@ bool FlagValue::ParseFrom(const char* value) {
     return true;
   }
 
-  // OK, it's likely to be numeric, and we'll be using a strtoXXX method.
-  if (value[0] == '\0')   // empty-string is only allowed for string type.
-    return false;
-  char* end;
-  // Leading 0x puts us in base 16.  But leading 0 does not put us in base 8!
-  // It caused too many bugs when we had that behavior.
-  int base = 10;    // by default
-  if (value[0] == '0' && (value[1] == 'x' || value[1] == 'X'))
-    base = 16;
-  errno = 0;
-
+  // OK, it's likely to be numeric.  Leading 0x puts us in base 16.  But
+  // leading 0 does not put us in base 8!  It caused too many bugs when we
+  // had that behavior.  See the number parsing routines in util.h.
   switch (type_) {
     case FV_INT32: {
-      const int64 r = strto64(value, &end, base);
-      if (errno || end != value + strlen(value))  return false;  // bad parse
+      int64 r;
+      if (!ParseInt64(value, &r))  return false;  // bad parse
       if (static_cast<int32>(r) != r)  // worked, but number out of range
         return false;
       SET_VALUE_AS(int32, static_cast<int32>(r));
       return true;
     }
     case FV_UINT32: {
-      while (*value == ' ') value++;
-      if (*value == '-') return false;  // negative number
-      const uint64 r = strtou64(value, &end, base);
-      if (errno || end != value + strlen(value))  return false;  // bad parse
-        if (static_cast<uint32>(r) != r)  // worked, but number out of range
+      const char* sign = value;
+      while (*sign == ' ') sign++;
+      if (*sign == '-') return false;  // negative number
+      uint64 r;
+      // Pass on the spaces, so that " 0x10" is rejected like for int64.
+      if (!ParseUint64(value, &r))  return false;  // bad parse
+      if (static_cast<uint32>(r) != r)  // worked, but number out of range
         return false;
       SET_VALUE_AS(uint32, static_cast<uint32>(r));
       return true;
     }
     case FV_INT64: {
-      const int64 r = strto64(value, &end, base);
-      if (errno || end != value + strlen(value))  return false;  // bad parse
+      int64 r;
+      if (!ParseInt64(value, &r))  return false;  // bad parse
       SET_VALUE_AS(int64, r);
       return true;
     }
     case FV_UINT64: {
-      while (*value == ' ') value++;
-      if (*value == '-') return false;  // negative number
-      const uint64 r = strtou64(value, &end, base);
-      if (errno || end != value + strlen(value))  return false;  // bad parse
+      const char* sign = value;
+      while (*sign == ' ') sign++;
+      if (*sign == '-') return false;  // negative number
+      uint64 r;
+      // Pass on the spaces, so that " 0x10" is rejected like for int64.
+      if (!ParseUint64(value, &r))  return false;  // bad parse
       SET_VALUE_AS(uint64, r);
       return true;
     }
     case FV_DOUBLE: {
-      const double r = strtod(value, &end);
-      if (errno || end != value + strlen(value))  return false;  // bad parse
+      double r;
+      if (!ParseDouble(value, &r))  return false;  // bad parse
       SET_VALUE_AS(double, r);
       return true;
     }
@@ -368,31 +416,41 @@ bool FlagValue::ParseFrom(const char* value) {
 }
 
 string FlagValue::ToString() const {
-  char intbuf[64];    // enough to hold even the biggest number
+  string result;
+  AppendTo(&result);
+  return result;
+}
+
+void FlagValue::AppendTo(string* output) const {
+  char buffer[kFastToBufferSize];
+  const char* end;
   switch (type_) {
     case FV_BOOL:
-      return VALUE_AS(bool) ? "true" : "false";
+      output->append(VALUE_AS(bool) ? "true" : "false");
+      return;
     case FV_INT32:
-      snprintf(intbuf, sizeof(intbuf), "%" PRId32, VALUE_AS(int32));
-      return intbuf;
+      end = FormatInt64(VALUE_AS(int32), buffer);
+      break;
     case FV_UINT32:
-      snprintf(intbuf, sizeof(intbuf), "%" PRIu32, VALUE_AS(uint32));
-      return intbuf;
+      end = FormatUint64(VALUE_AS(uint32), buffer);
+      break;
     case FV_INT64:
-      snprintf(intbuf, sizeof(intbuf), "%" PRId64, VALUE_AS(int64));
-      return intbuf;
+      end = FormatInt64(VALUE_AS(int64), buffer);
+      break;
     case FV_UINT64:
-      snprintf(intbuf, sizeof(intbuf), "%" PRIu64, VALUE_AS(uint64));
-      return intbuf;
+      end = FormatUint64(VALUE_AS(uint64), buffer);
+      break;
     case FV_DOUBLE:
-      snprintf(intbuf, sizeof(intbuf), "%.17g", VALUE_AS(double));
-      return intbuf;
+      end = FormatDouble(VALUE_AS(double), buffer);
+      break;
     case FV_STRING:
-      return VALUE_AS(string);
+      output->append(VALUE_AS(string));
+      return;
     default:
-      assert(false);
-      return "";  // unknown type
+      assert(false);  // unknown type
+      return;
   }
+  output->append(buffer, end - buffer);
 }
 
 bool FlagValue::Validate(const char* flagname,
@@ -484,6 +542,34 @@ void FlagValue::CopyFrom(const FlagValue& x) {
   }
 }
 
+void FlagValue::MoveFrom(FlagValue* x) {
+  if (type_ == FV_STRING) {
+    assert(x->type_ == FV_STRING);
+    string& other = OTHER_VALUE_AS((*x), string);
+    (VALUE_AS(string)).swap(other);
+  } else {
+    CopyFrom(*x);
+  }
+}
+
+void FlagValue::SwapWith(FlagValue* x) {
+  assert(type_ == x->type_);
+  FlagValue& other = *x;
+#define SWAP_VALUE_AS(type) \
+  std::swap(VALUE_AS(type), OTHER_VALUE_AS(other, type))
+  switch (type_) {
+    case FV_BOOL:   SWAP_VALUE_AS(bool);    break;
+    case FV_INT32:  SWAP_VALUE_AS(int32);   break;
+    case FV_UINT32: SWAP_VALUE_AS(uint32);  break;
+    case FV_INT64:  SWAP_VALUE_AS(int64);   break;
+    case FV_UINT64: SWAP_VALUE_AS(uint64);  break;
+    case FV_DOUBLE: SWAP_VALUE_AS(double);  break;
+    case FV_STRING: SWAP_VALUE_AS(string);  break;
+    default: assert(false);  // unknown type
+  }
+#undef SWAP_VALUE_AS
+}
+
 // --------------------------------------------------------------------
 // CommandLineFlag
 //    This represents a single flag, including its name, description,
@@ -497,10 +583,10 @@ void FlagValue::CopyFrom(const FlagValue& x) {
 
 class CommandLineFlag {
  public:
-  // Note: we take over memory-ownership of current_val and default_val.
+  // Note: current_val and default_val must live as long as we do.  Like
+  // us, they live in a registry's arena, which never destroys them.
   CommandLineFlag(const char* name, const char* help, const char* filename,
                   FlagValue* current_val, FlagValue* default_val);
-  ~CommandLineFlag();
 
   const char* name() const { return name_; }
   const char* help() const { return help_; }
@@ -508,35 +594,45 @@ class CommandLineFlag {
   const char* CleanFileName() const;  // nixes irrelevant prefix such as homedir
   string current_value() const { return current_->ToString(); }
   string default_value() const { return defvalue_->ToString(); }
+  void AppendCurrentValue(string* output) const { current_->AppendTo(output); }
+  void AppendDefaultValue(string* output) const { defvalue_->AppendTo(output); }
   const char* type_name() const { return defvalue_->TypeName(); }
   ValidateFnProto validate_function() const { return validate_fn_proto_; }
   const void* flag_ptr() const { return current_->value_buffer_; }
 
   FlagValue::ValueType Type() const { return defvalue_->Type(); }
 
-  void FillCommandLineFlagInfo(struct CommandLineFlagInfo* result);
+  // This only reads the flag, so the registry's reader lock suffices.
+  // Hence it does not update the modified bit; if result->is_default
+  // is false while Modified() is still false, the caller should call
+  // UpdateModifiedBit() once it holds the registry lock exclusively.
+  void FillCommandLineFlagInfo(struct CommandLineFlagInfo* result) const;
 
   // If validate_fn_proto_ is non-NULL, calls it on value, returns result.
   bool Validate(const FlagValue& value) const;
   bool ValidateCurrent() const { return Validate(*current_); }
   bool Modified() const { return modified_; }
+  // What CommandLineFlagInfo::is_default says.  If this is false while
+  // Modified() is still false, see FillCommandLineFlagInfo().
+  bool IsDefault() const { return !modified_ && current_->Equal(*defvalue_); }
+
+  // Sets the modified bit if the current value differs from the default,
+  // in case somebody wrote it through FLAGS_name.  Needs the registry
+  // lock held exclusively.
+  void UpdateModifiedBit();
 
  private:
   // for SetFlagLocked() and setting flags_by_ptr_
   friend class FlagRegistry;
-  friend class GFLAGS_NAMESPACE::FlagSaverImpl;  // for cloning the values
-  // set validate_fn
-  friend bool AddFlagValidator(const void*, ValidateFnProto);
-
-  // This copies all the non-const members: modified, processed, defvalue, etc.
-  void CopyFrom(const CommandLineFlag& src);
-
-  void UpdateModifiedBit();
+  friend class GFLAGS_NAMESPACE::FlagSaverImpl;  // saves and restores us
+  friend class GFLAGS_NAMESPACE::FlagHandle;     // gets our current value
+  friend class CommandLineFlagParser;  // copies values to validate them
 
   const char* const name_;     // Flag name
   const char* const help_;     // Help message
   const char* const file_;     // Which file did this come from?
   bool modified_;              // Set after default assignment?
+  bool has_had_validator_;     // In the registry's flags_with_validators_?
   FlagValue* defvalue_;        // Default value for flag
   FlagValue* current_;         // Current value for flag
   // This is a casted, 'generic' version of validate_fn, which actually
@@ -553,12 +649,8 @@ CommandLineFlag::CommandLineFlag(const char* name, const char* help,
                                  const char* filename,
                                  FlagValue* current_val, FlagValue* default_val)
     : name_(name), help_(help), file_(filename), modified_(false),
-      defvalue_(default_val), current_(current_val), validate_fn_proto_(NULL) {
-}
-
-CommandLineFlag::~CommandLineFlag() {
-  delete current_;
-  delete defvalue_;
+      has_had_validator_(false), defvalue_(default_val), current_(current_val),
+      validate_fn_proto_(NULL) {
 }
 
 const char* CommandLineFlag::CleanFileName() const {
@@ -573,15 +665,16 @@ const char* CommandLineFlag::CleanFileName() const {
 }
 
 void CommandLineFlag::FillCommandLineFlagInfo(
-    CommandLineFlagInfo* result) {
+    CommandLineFlagInfo* result) const {
   result->name = name();
   result->type = type_name();
   result->description = help();
-  result->current_value = current_value();
-  result->default_value = default_value();
+  result->current_value.clear();
+  current_->AppendTo(&result->current_value);
+  result->default_value.clear();
+  defvalue_->AppendTo(&result->default_value);
   result->filename = CleanFileName();
-  UpdateModifiedBit();
-  result->is_default = !modified_;
+  result->is_default = IsDefault();
   result->has_validator_fn = validate_function() != NULL;
   result->flag_ptr = flag_ptr();
 }
@@ -594,15 +687,6 @@ void CommandLineFlag::UpdateModifiedBit() {
   }
 }
 
-void CommandLineFlag::CopyFrom(const CommandLineFlag& src) {
-  // Note we only copy the non-const members; others are fixed at construct time
-  if (modified_ != src.modified_) modified_ = src.modified_;
-  if (!current_->Equal(*src.current_)) current_->CopyFrom(*src.current_);
-  if (!defvalue_->Equal(*src.defvalue_)) defvalue_->CopyFrom(*src.defvalue_);
-  if (validate_fn_proto_ != src.validate_fn_proto_)
-    validate_fn_proto_ = src.validate_fn_proto_;
-}
-
 bool CommandLineFlag::Validate(const FlagValue& value) const {
 
   if (validate_function() == NULL)
@@ -622,80 +706,283 @@ bool CommandLineFlag::Validate(const FlagValue& value) const {
 //    the function will acquire it itself if needed.
 // --------------------------------------------------------------------
 
-struct StringCmp {  // Used by the FlagRegistry map class to compare char*'s
-  bool operator() (const char* s1, const char* s2) const {
-    return (strcmp(s1, s2) < 0);
+// Returns a hash of the first len characters of name.  We use 32-bit
+// FNV-1a, which is cheap and spreads the short, identifier-like flag
+// names we deal with well enough for an open-addressing table.
+static inline uint32 FlagNameHash(const char* name, size_t len) {
+  uint32 hash = 2166136261u;
+  for (size_t i = 0; i < len; ++i) {
+    hash ^= static_cast<uint8>(name[i]);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+// A bump allocator for objects which live exactly as long as the
+// registry that owns the arena.  Allocations are carved out of large
+// blocks one after the other, so objects allocated in sequence end up
+// next to each other in memory.  The arena never runs destructors; it
+// just frees its blocks when it is destroyed.  Thread-compatible.
+class FlagArena {
+ public:
+  FlagArena() : next_(NULL), remaining_(0) { }
+  ~FlagArena() {
+    for (vector<char*>::iterator it = blocks_.begin();
+         it != blocks_.end(); ++it) {
+      free(*it);
+    }
+  }
+
+  // Returns size bytes of memory suitably aligned for any registry object.
+  void* Allocate(size_t size) {
+    size = (size + kAlignment - 1) & ~(kAlignment - 1);
+    if (size > remaining_) {
+      const size_t block_size = size > kBlockSize ? size : kBlockSize;
+      next_ = static_cast<char*>(malloc(block_size));
+      if (next_ == NULL) {
+        ReportError(DIE, "ERROR: out of memory for flag registry\n");
+      }
+      blocks_.push_back(next_);
+      remaining_ = block_size;
+    }
+    void* const result = next_;
+    next_ += size;
+    remaining_ -= size;
+    return result;
+  }
+
+ private:
+  // Enough for the pointers, int64s and doubles our objects contain.
+  union MaxAlign { void* p; int64 i; double d; };
+  static const size_t kAlignment = sizeof(MaxAlign);
+  static const size_t kBlockSize = 16 * 1024;
+
+  vector<char*> blocks_;
+  char* next_;          // start of the free part of the newest block
+  size_t remaining_;    // bytes left in the newest block
+
+  FlagArena(const FlagArena&);   // no copying!
+  void operator=(const FlagArena&);
+};
+
+// The order in which GetAllFlags() and VisitAllFlags() report flags:
+// first by the file they are defined in, then by name.
+struct FilenameFlagnameCmp {
+  bool operator()(const CommandLineFlag* a, const CommandLineFlag* b) const {
+    int cmp = strcmp(a->CleanFileName(), b->CleanFileName());
+    if (cmp == 0)
+      cmp = strcmp(a->name(), b->name());  // secondary sort key
+    return cmp < 0;
   }
 };
 
+// Sorts the entries of *v after its first *num_sorted ones and merges
+// them into that sorted prefix, once there are more of them than both
+// a fixed length and a fraction of the prefix.  Appending n entries one
+// at a time and calling this after each thus costs O(n log n) overall.
+template <typename T, typename Cmp>
+static void MergeLongUnsortedTail(vector<T>* v, size_t* num_sorted, Cmp cmp) {
+  const size_t num_unsorted = v->size() - *num_sorted;
+  if (num_unsorted > 64 && num_unsorted > *num_sorted / 16) {
+    const typename vector<T>::iterator middle = v->begin() + *num_sorted;
+    std::sort(middle, v->end(), cmp);
+    std::inplace_merge(v->begin(), middle, v->end(), cmp);
+    *num_sorted = v->size();
+  }
+}
+
 
 class FlagRegistry {
  public:
-  FlagRegistry() {
-  }
-  ~FlagRegistry() {
-    // Not using STLDeleteElements as that resides in util and this
-    // class is base.
-    for (FlagMap::iterator p = flags_.begin(), e = flags_.end(); p != e; ++p) {
-      CommandLineFlag* flag = p->second;
-      delete flag;
-    }
+  FlagRegistry()
+      : num_flags_by_name_(0), num_sorted_by_ptr_(0), num_sorted_by_file_(0),
+        undo_log_(NULL) {
   }
+  // The flags of this registry live in arena_, which frees them.  We
+  // don't need to run their destructors, because the FlagValues of
+  // registered flags never own the memory of the value they point to.
+  ~FlagRegistry() { }
 
   static void DeleteGlobalRegistry() {
     delete global_registry_;
     global_registry_ = NULL;
   }
 
-  // Store a flag in this registry.  Takes ownership of the given pointer.
-  void RegisterFlag(CommandLineFlag* flag);
+  // Store a flag in this registry.  The flag and its values must have
+  // been allocated with AllocateLocked(), and must not own their values.
+  void RegisterFlagLocked(CommandLineFlag* flag);
+
+  // Returns memory for a CommandLineFlag or FlagValue which will live
+  // as long as this registry.  The memory is freed by the registry.
+  void* AllocateLocked(size_t size) { return arena_.Allocate(size); }
+
+  // Gives flag the validate function validate_fn_proto, or takes its
+  // validate function away if that is NULL.
+  void SetValidateFunctionLocked(CommandLineFlag* flag,
+                                 ValidateFnProto validate_fn_proto);
 
   void Lock() { lock_.Lock(); }
   void Unlock() { lock_.Unlock(); }
 
+  // Acquire the lock shared, for operations that only read flags.
+  // Holding the reader lock is enough to call the const FooLocked()
+  // functions below, and to read (but not write) CommandLineFlags.
+  void ReaderLock() { lock_.ReaderLock(); }
+  void ReaderUnlock() { lock_.ReaderUnlock(); }
+
   // Returns the flag object for the specified name, or NULL if not found.
-  CommandLineFlag* FindFlagLocked(const char* name);
+  CommandLineFlag* FindFlagLocked(const char* name) const {
+    return FindFlagLocked(name, strlen(name));
+  }
+  // The same for the name made up of the first len characters of name,
+  // which need not be NUL-terminated.
+  CommandLineFlag* FindFlagLocked(const char* name, size_t len) const;
+  // The same for a name whose FlagNameHash() the caller already knows.
+  // Unlike the above, this only finds a flag of exactly that name.
+  CommandLineFlag* FindFlagLocked(const char* name, size_t len,
+                                  uint32 hash) const {
+    if (flags_by_name_.empty()) return NULL;
+    return FindSlotLocked(name, len, hash)->flag;
+  }
 
   // Returns the flag object whose current-value is stored at flag_ptr.
   // That is, for whom current_->value_buffer_ == flag_ptr
-  CommandLineFlag* FindFlagViaPtrLocked(const void* flag_ptr);
-
-  // A fancier form of FindFlag that works correctly if name is of the
-  // form flag=value.  In that case, we set key to point to flag, and
-  // modify v to point to the value (if present), and return the flag
-  // with the given name.  If the flag does not exist, returns NULL
-  // and sets error_message.
-  CommandLineFlag* SplitArgumentLocked(const char* argument,
-                                       string* key, const char** v,
+  CommandLineFlag* FindFlagViaPtrLocked(const void* flag_ptr) const;
+
+  // Stores all flags in *flags, sorted by FilenameFlagnameCmp.  This
+  // only has to sort the few flags registered since the last merge.
+  void GetFlagsSortedByFileLocked(vector<CommandLineFlag*>* flags) const;
+
+  // A fancier form of FindFlag that works correctly if the first
+  // arg_len characters of argument, which need not be NUL-terminated,
+  // are of the form flag=value.  In that case, we point key at flag and
+  // set key_len, point v at the value (if present) and set v_len, and
+  // return the flag with the given name.  Note that neither the key nor
+  // the value need be NUL-terminated.  If the flag does not exist,
+  // returns NULL and sets error_message.  This allocates no memory
+  // unless it has to report an error, not even for --noflag.
+  CommandLineFlag* SplitArgumentLocked(const char* argument, size_t arg_len,
+                                       const char** key, size_t* key_len,
+                                       const char** v, size_t* v_len,
                                        string* error_message);
 
   // Set the value of a flag.  If the flag was successfully set to
   // value, set msg to indicate the new flag-value, and return true.
-  // Otherwise, set msg to indicate the error, leave flag unchanged,
-  // and return false.  msg can be NULL.
+  // Otherwise, set error to indicate the error, leave flag unchanged,
+  // and return false.  msg and error can be NULL, and can be the same.
   bool SetFlagLocked(CommandLineFlag* flag, const char* value,
-                     FlagSettingMode set_mode, string* msg);
+                     FlagSettingMode set_mode, string* msg, string* error) {
+    return SetFlagLocked(flag, value, NULL, set_mode, msg, error);
+  }
+  // The same for a value which has already been parsed into a FlagValue
+  // of the flag's type.
+  bool SetFlagLocked(CommandLineFlag* flag, const FlagValue& value,
+                     FlagSettingMode set_mode, string* msg, string* error) {
+    return SetFlagLocked(flag, NULL, &value, set_mode, msg, error);
+  }
+
+  // While undo_log is not NULL, SetFlagLocked() saves the state of
+  // each flag into it before it first changes that flag, so that
+  // undo_log->RestoreToRegistry() can undo the changes.  Only set this
+  // for as long as you hold the lock, or others' changes get in too.
+  void SetUndoLogLocked(FlagSaverImpl* undo_log) { undo_log_ = undo_log; }
 
   static FlagRegistry* GlobalRegistry();   // returns a singleton registry
 
  private:
+  // Does the work of both SetFlagLocked()s: sets the flag to
+  // parsed_value, unless that is NULL, in which case it parses value.
+  bool SetFlagLocked(CommandLineFlag* flag, const char* value,
+                     const FlagValue* parsed_value, FlagSettingMode set_mode,
+                     string* msg, string* error);
+  // Saves the state of flag into undo_log_, which must not be NULL.
+  void SaveToUndoLogLocked(CommandLineFlag* flag);
+
   friend class GFLAGS_NAMESPACE::FlagSaverImpl;  // reads all the flags in order to copy them
   friend class CommandLineFlagParser;    // for ValidateUnmodifiedFlags
-  friend void GFLAGS_NAMESPACE::GetAllFlags(vector<CommandLineFlagInfo>*);
+  friend void GFLAGS_NAMESPACE::VisitAllFlags(CommandLineFlagVisitor*);
+
+  // All flags of this registry in the order they were registered.
+  // This is what we iterate over; it owns the CommandLineFlags.
+  typedef vector<CommandLineFlag*> FlagList;
+  typedef FlagList::iterator FlagIterator;
+  typedef FlagList::const_iterator FlagConstIterator;
+  FlagList flags_;
+
+  // Every flag that has, or once had, a validate function, in the
+  // order they got their first one.  Flags without a validate function
+  // always pass validation, so ValidateFlags() need only look at these.
+  // We never remove a flag from here, because a FlagSaver may give it
+  // back the validate function it had when the FlagSaver was created.
+  FlagList flags_with_validators_;
+
+  // The index from name to flag, for FindFlagLocked().  This is an
+  // open-addressing hash table with linear probing.  Each slot keeps
+  // the full hash and the length of its flag's name, so that almost all
+  // probes that don't match are rejected without touching the name
+  // itself, and a name is never read past its end.  The
+  // number of slots is a power of two (or zero), and we keep the table
+  // at most half full so probe sequences stay short.
+  struct FlagSlot {
+    uint32 hash;
+    uint32 name_len;
+    CommandLineFlag* flag;    // NULL for an empty slot
+  };
+  vector<FlagSlot> flags_by_name_;
+  size_t num_flags_by_name_;
+
+  // Returns the slot holding the flag named by the first len characters
+  // of name (whose hash is given), or the empty slot where such a flag
+  // would go.  The table must not be empty.
+  const FlagSlot* FindSlotLocked(const char* name, size_t len,
+                                 uint32 hash) const;
+  FlagSlot* FindSlotLocked(const char* name, size_t len, uint32 hash) {
+    const FlagRegistry* const self = this;
+    return const_cast<FlagSlot*>(self->FindSlotLocked(name, len, hash));
+  }
+
+  // Adds flag to flags_by_name_ and returns NULL, unless a flag of the
+  // same name is already present, in which case that one is returned.
+  CommandLineFlag* InsertByNameLocked(CommandLineFlag* flag);
+
+  // The index from current-value pointer to flag, for
+  // FindFlagViaPtrLocked().  Only its first num_sorted_by_ptr_ entries
+  // are sorted by pointer; RegisterFlag() appends to the unsorted tail
+  // and merges it into the sorted part once the tail gets long.  This
+  // keeps registration during static initialization cheap, at the
+  // expense of a short linear scan in the rare pointer lookups.
+  struct FlagPtrEntry {
+    const void* ptr;
+    CommandLineFlag* flag;
+    bool operator<(const FlagPtrEntry& other) const {
+      return std::less<const void*>()(ptr, other.ptr);
+    }
+  };
+  vector<FlagPtrEntry> flags_by_ptr_;
+  size_t num_sorted_by_ptr_;
+
+  // All flags in the order of FilenameFlagnameCmp, for
+  // GetFlagsSortedByFileLocked().  Like flags_by_ptr_, only its first
+  // num_sorted_by_file_ entries are sorted, and RegisterFlag() merges
+  // the rest into them once there are enough.
+  vector<CommandLineFlag*> flags_by_file_;
+  size_t num_sorted_by_file_;
 
-  // The map from name to flag, for FindFlagLocked().
-  typedef map<const char*, CommandLineFlag*, StringCmp> FlagMap;
-  typedef FlagMap::iterator FlagIterator;
-  typedef FlagMap::const_iterator FlagConstIterator;
-  FlagMap flags_;
+  // Holds the CommandLineFlags and FlagValues of all registered flags.
+  // Registering a flag allocates the flag right after its two values,
+  // so iterating over all flags in registration order touches memory
+  // sequentially rather than hopping between heap allocations.
+  FlagArena arena_;
 
-  // The map from current-value pointer to flag, fo FindFlagViaPtrLocked().
-  typedef map<const void*, CommandLineFlag*> FlagPtrMap;
-  FlagPtrMap flags_by_ptr_;
+  FlagSaverImpl* undo_log_;   // see SetUndoLogLocked()
 
   static FlagRegistry* global_registry_;   // a singleton registry
 
+#ifdef READER_BIASED_LOCK
+  ReaderBiasedMutex lock_;
+#else
   Mutex lock_;
+#endif
 
   static void InitGlobalRegistry();
 
@@ -712,17 +999,25 @@ class FlagRegistryLock {
   FlagRegistry *const fr_;
 };
 
+class FlagRegistryReaderLock {
+ public:
+  explicit FlagRegistryReaderLock(FlagRegistry* fr) : fr_(fr) {
+    fr_->ReaderLock();
+  }
+  ~FlagRegistryReaderLock() { fr_->ReaderUnlock(); }
+ private:
+  FlagRegistry *const fr_;
+};
+
 
-void FlagRegistry::RegisterFlag(CommandLineFlag* flag) {
-  Lock();
-  pair<FlagIterator, bool> ins =
-    flags_.insert(pair<const char*, CommandLineFlag*>(flag->name(), flag));
-  if (ins.second == false) {   // means the name was already in the map
-    if (strcmp(ins.first->second->filename(), flag->filename()) != 0) {
+void FlagRegistry::RegisterFlagLocked(CommandLineFlag* flag) {
+  CommandLineFlag* const existing = InsertByNameLocked(flag);
+  if (existing != NULL) {   // means the name was already in the map
+    if (strcmp(existing->filename(), flag->filename()) != 0) {
       ReportError(DIE, "ERROR: flag '%s' was defined more than once "
                   "(in files '%s' and '%s').\n",
                   flag->name(),
-                  ins.first->second->filename(),
+                  existing->filename(),
                   flag->filename());
     } else {
       ReportError(DIE, "ERROR: something wrong with flag '%s' in file '%s'.  "
@@ -732,134 +1027,305 @@ void FlagRegistry::RegisterFlag(CommandLineFlag* flag) {
                   flag->filename(), flag->filename());
     }
   }
-  // Also add to the flags_by_ptr_ map.
-  flags_by_ptr_[flag->current_->value_buffer_] = flag;
-  Unlock();
+  flags_.push_back(flag);
+  // Also add to the flags_by_ptr_ and flags_by_file_ indices.
+  const FlagPtrEntry entry = { flag->current_->value_buffer_, flag };
+  flags_by_ptr_.push_back(entry);
+  MergeLongUnsortedTail(&flags_by_ptr_, &num_sorted_by_ptr_,
+                        std::less<FlagPtrEntry>());
+  flags_by_file_.push_back(flag);
+  MergeLongUnsortedTail(&flags_by_file_, &num_sorted_by_file_,
+                        FilenameFlagnameCmp());
+}
+
+void FlagRegistry::GetFlagsSortedByFileLocked(
+    vector<CommandLineFlag*>* flags) const {
+  const vector<CommandLineFlag*>::const_iterator sorted_end =
+      flags_by_file_.begin() + num_sorted_by_file_;
+  vector<CommandLineFlag*> tail(sorted_end, flags_by_file_.end());
+  std::sort(tail.begin(), tail.end(), FilenameFlagnameCmp());
+  flags->resize(flags_by_file_.size());
+  std::merge(flags_by_file_.begin(), sorted_end, tail.begin(), tail.end(),
+             flags->begin(), FilenameFlagnameCmp());
+}
+
+void FlagRegistry::SetValidateFunctionLocked(
+    CommandLineFlag* flag, ValidateFnProto validate_fn_proto) {
+  if (validate_fn_proto != NULL && !flag->has_had_validator_) {
+    flags_with_validators_.push_back(flag);
+    flag->has_had_validator_ = true;
+  }
+  flag->validate_fn_proto_ = validate_fn_proto;
+}
+
+const FlagRegistry::FlagSlot* FlagRegistry::FindSlotLocked(
+    const char* name, size_t len, uint32 hash) const {
+  assert(!flags_by_name_.empty());
+  const size_t mask = flags_by_name_.size() - 1;
+  for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+    const FlagSlot* const slot = &flags_by_name_[i];
+    if (slot->flag == NULL ||
+        (slot->hash == hash && slot->name_len == len &&
+         memcmp(slot->flag->name(), name, len) == 0)) {
+      return slot;
+    }
+  }
 }
 
-CommandLineFlag* FlagRegistry::FindFlagLocked(const char* name) {
-  FlagConstIterator i = flags_.find(name);
-  if (i == flags_.end()) {
+CommandLineFlag* FlagRegistry::InsertByNameLocked(CommandLineFlag* flag) {
+  // Grow (or create) the table first if this insert would leave it
+  // more than half full.
+  if (2 * (num_flags_by_name_ + 1) > flags_by_name_.size()) {
+    vector<FlagSlot> old_slots;
+    old_slots.swap(flags_by_name_);
+    const FlagSlot empty = { 0, 0, NULL };
+    flags_by_name_.assign(old_slots.empty() ? 64 : 2 * old_slots.size(),
+                          empty);
+    const size_t mask = flags_by_name_.size() - 1;
+    for (vector<FlagSlot>::const_iterator it = old_slots.begin();
+         it != old_slots.end(); ++it) {
+      if (it->flag == NULL) continue;
+      size_t i = it->hash & mask;
+      while (flags_by_name_[i].flag != NULL) i = (i + 1) & mask;
+      flags_by_name_[i] = *it;
+    }
+  }
+  const size_t len = strlen(flag->name());
+  const uint32 hash = FlagNameHash(flag->name(), len);
+  FlagSlot* const slot = FindSlotLocked(flag->name(), len, hash);
+  if (slot->flag != NULL)
+    return slot->flag;
+  slot->hash = hash;
+  slot->name_len = static_cast<uint32>(len);
+  slot->flag = flag;
+  ++num_flags_by_name_;
+  return NULL;
+}
+
+CommandLineFlag* FlagRegistry::FindFlagLocked(const char* name,
+                                              size_t len) const {
+  CommandLineFlag* flag = NULL;
+  if (!flags_by_name_.empty())
+    flag = FindSlotLocked(name, len, FlagNameHash(name, len))->flag;
+  if (flag == NULL) {
     // If the name has dashes in it, try again after replacing with
-    // underscores.
-    if (strchr(name, '-') == NULL) return NULL;
-    string name_rep = name;
+    // underscores.  Unless the name is very long, we do so on the stack
+    // rather than allocating a copy.
+    if (memchr(name, '-', len) == NULL) return NULL;
+    char buffer[128];
+    if (len <= sizeof(buffer)) {
+      std::replace_copy(name, name + len, buffer, '-', '_');
+      return FindFlagLocked(buffer, len);
+    }
+    string name_rep(name, len);
     std::replace(name_rep.begin(), name_rep.end(), '-', '_');
-    return FindFlagLocked(name_rep.c_str());
+    return FindFlagLocked(name_rep.data(), name_rep.size());
   } else {
-    return i->second;
+    return flag;
   }
 }
 
-CommandLineFlag* FlagRegistry::FindFlagViaPtrLocked(const void* flag_ptr) {
-  FlagPtrMap::const_iterator i = flags_by_ptr_.find(flag_ptr);
-  if (i == flags_by_ptr_.end()) {
-    return NULL;
-  } else {
-    return i->second;
+CommandLineFlag* FlagRegistry::FindFlagViaPtrLocked(
+    const void* flag_ptr) const {
+  const FlagPtrEntry key = { flag_ptr, NULL };
+  const vector<FlagPtrEntry>::const_iterator sorted_end =
+      flags_by_ptr_.begin() + num_sorted_by_ptr_;
+  vector<FlagPtrEntry>::const_iterator i =
+      std::lower_bound(flags_by_ptr_.begin(), sorted_end, key);
+  if (i != sorted_end && i->ptr == flag_ptr)
+    return i->flag;
+  for (i = sorted_end; i != flags_by_ptr_.end(); ++i) {
+    if (i->ptr == flag_ptr)
+      return i->flag;
   }
+  return NULL;
 }
 
 CommandLineFlag* FlagRegistry::SplitArgumentLocked(const char* arg,
-                                                   string* key,
+                                                   size_t arg_len,
+                                                   const char** key,
+                                                   size_t* key_len,
                                                    const char** v,
+                                                   size_t* v_len,
                                                    string* error_message) {
   // Find the flag object for this option
-  const char* flag_name;
-  const char* value = strchr(arg, '=');
+  const char* const arg_end = arg + arg_len;
+  const char* value = static_cast<const char*>(memchr(arg, '=', arg_len));
+  *key = arg;
   if (value == NULL) {
-    key->assign(arg);
+    *key_len = arg_len;
     *v = NULL;
+    *v_len = 0;
   } else {
     // Strip out the "=value" portion from arg
-    key->assign(arg, value-arg);
+    *key_len = value - arg;
     *v = ++value;    // advance past the '='
+    *v_len = arg_end - value;
   }
-  flag_name = key->c_str();
+  const char* const flag_name = *key;
+  const size_t flag_name_len = *key_len;
 
-  CommandLineFlag* flag = FindFlagLocked(flag_name);
+  CommandLineFlag* flag = FindFlagLocked(flag_name, flag_name_len);
 
   if (flag == NULL) {
     // If we can't find the flag-name, then we should return an error.
     // The one exception is if 1) the flag-name is 'nox', 2) there
     // exists a flag named 'x', and 3) 'x' is a boolean flag.
     // In that case, we want to return flag 'x'.
-    if (!(flag_name[0] == 'n' && flag_name[1] == 'o')) {
+    if (!(flag_name_len >= 2 && flag_name[0] == 'n' && flag_name[1] == 'o')) {
       // flag-name is not 'nox', so we're not in the exception case.
-      *error_message = StringPrintf("%sunknown command line flag '%s'\n",
-                                    kError, key->c_str());
+      *error_message = StringPrintf("%sunknown command line flag '%.*s'\n",
+                                    kError, static_cast<int>(flag_name_len),
+                                    flag_name);
       return NULL;
     }
-    flag = FindFlagLocked(flag_name+2);
+    flag = FindFlagLocked(flag_name+2, flag_name_len-2);
     if (flag == NULL) {
       // No flag named 'x' exists, so we're not in the exception case.
-      *error_message = StringPrintf("%sunknown command line flag '%s'\n",
-                                    kError, key->c_str());
+      *error_message = StringPrintf("%sunknown command line flag '%.*s'\n",
+                                    kError, static_cast<int>(flag_name_len),
+                                    flag_name);
       return NULL;
     }
     if (flag->Type() != FlagValue::FV_BOOL) {
       // 'x' exists but is not boolean, so we're not in the exception case.
       *error_message = StringPrintf(
-          "%sboolean value (%s) specified for %s command line flag\n",
-          kError, key->c_str(), flag->type_name());
+          "%sboolean value (%.*s) specified for %s command line flag\n",
+          kError, static_cast<int>(flag_name_len), flag_name,
+          flag->type_name());
       return NULL;
     }
     // We're in the exception case!
     // Make up a fake value to replace the "no" we stripped out
-    key->assign(flag_name+2);   // the name without the "no"
+    *key = flag_name+2;   // the name without the "no"
+    *key_len = flag_name_len-2;
     *v = "0";
+    *v_len = 1;
   }
 
   // Assign a value if this is a boolean flag
   if (*v == NULL && flag->Type() == FlagValue::FV_BOOL) {
     *v = "1";    // the --nox case was already handled, so this is the --x case
+    *v_len = 1;
   }
 
   return flag;
 }
 
-bool TryParseLocked(const CommandLineFlag* flag, FlagValue* flag_value,
-                    const char* value, string* msg) {
-  // Use tenative_value, not flag_value, until we know value is valid.
-  FlagValue* tentative_value = flag_value->New();
-  if (!tentative_value->ParseFrom(value)) {
-    if (msg) {
-      StringAppendF(msg,
+// Returns true if new_value passes the validator of flag; otherwise
+// appends the reason to error, unless that is NULL.
+static bool ValidateNewValueLocked(const CommandLineFlag* flag,
+                                   const FlagValue& new_value,
+                                   string* error) {
+  if (flag->Validate(new_value))
+    return true;
+  if (error) {
+    StringAppendF(error,
+        "%sfailed validation of new value '%s' for flag '%s'\n",
+        kError, new_value.ToString().c_str(),
+        flag->name());
+  }
+  return false;
+}
+
+// Appends the new value of flag_value to msg, unless that is NULL.
+static void DescribeNewValueLocked(const CommandLineFlag* flag,
+                                   const FlagValue& flag_value,
+                                   string* msg) {
+  if (msg) {
+    // Enough for any value but a long string, so that we grow msg once.
+    msg->reserve(msg->size() + strlen(flag->name()) + kFastToBufferSize + 10);
+    msg->append(flag->name());
+    msg->append(" set to ");
+    flag_value.AppendTo(msg);
+    msg->append("\n");
+  }
+}
+
+bool TrySetLocked(const CommandLineFlag* flag, FlagValue* flag_value,
+                  const FlagValue& new_value, string* msg, string* error) {
+  if (!ValidateNewValueLocked(flag, new_value, error))
+    return false;
+  flag_value->CopyFrom(new_value);
+  DescribeNewValueLocked(flag, *flag_value, msg);
+  return true;
+}
+
+// Does the work of TryParseLocked() for a flag of type T.
+template <typename T>
+bool TryParseAsLocked(const CommandLineFlag* flag, FlagValue* flag_value,
+                      const char* value, string* msg, string* error) {
+  // Use tentative_value, not flag_value, until we know value is valid.
+  // It lives on the stack, and we move rather than copy it into
+  // flag_value, so that setting a flag needs no memory of its own.
+  T storage = T();
+  FlagValue tentative_value(&storage, false);
+  if (!tentative_value.ParseFrom(value)) {
+    if (error) {
+      StringAppendF(error,
                     "%sillegal value '%s' specified for %s flag '%s'\n",
                     kError, value,
                     flag->type_name(), flag->name());
     }
-    delete tentative_value;
     return false;
-  } else if (!flag->Validate(*tentative_value)) {
-    if (msg) {
-      StringAppendF(msg,
-          "%sfailed validation of new value '%s' for flag '%s'\n",
-          kError, tentative_value->ToString().c_str(),
-          flag->name());
-    }
-    delete tentative_value;
+  }
+  if (!ValidateNewValueLocked(flag, tentative_value, error))
     return false;
-  } else {
-    flag_value->CopyFrom(*tentative_value);
-    if (msg) {
-      StringAppendF(msg, "%s set to %s\n",
-                    flag->name(), flag_value->ToString().c_str());
-    }
-    delete tentative_value;
-    return true;
+  flag_value->MoveFrom(&tentative_value);
+  DescribeNewValueLocked(flag, *flag_value, msg);
+  return true;
+}
+
+// Sets flag_value to the result of parsing value, if it is valid and
+// passes the validator of flag.  Otherwise, appends the reason to error
+// and returns false.  msg and error can be NULL.
+static bool TryParseLocked(const CommandLineFlag* flag, FlagValue* flag_value,
+                           const char* value, string* msg, string* error) {
+  switch (flag_value->Type()) {
+    case FlagValue::FV_BOOL:
+      return TryParseAsLocked<bool>(flag, flag_value, value, msg, error);
+    case FlagValue::FV_INT32:
+      return TryParseAsLocked<int32>(flag, flag_value, value, msg, error);
+    case FlagValue::FV_UINT32:
+      return TryParseAsLocked<uint32>(flag, flag_value, value, msg, error);
+    case FlagValue::FV_INT64:
+      return TryParseAsLocked<int64>(flag, flag_value, value, msg, error);
+    case FlagValue::FV_UINT64:
+      return TryParseAsLocked<uint64>(flag, flag_value, value, msg, error);
+    case FlagValue::FV_DOUBLE:
+      return TryParseAsLocked<double>(flag, flag_value, value, msg, error);
+    case FlagValue::FV_STRING:
+      return TryParseAsLocked<string>(flag, flag_value, value, msg, error);
+    default:
+      assert(false);  // unknown type
+      return false;
   }
 }
 
+// Sets flag_value to parsed_value if that isn't NULL, or else to the
+// result of parsing value.
+static bool TryAssignLocked(const CommandLineFlag* flag,
+                            FlagValue* flag_value, const char* value,
+                            const FlagValue* parsed_value,
+                            string* msg, string* error) {
+  if (parsed_value != NULL)
+    return TrySetLocked(flag, flag_value, *parsed_value, msg, error);
+  return TryParseLocked(flag, flag_value, value, msg, error);
+}
+
 bool FlagRegistry::SetFlagLocked(CommandLineFlag* flag,
                                  const char* value,
+                                 const FlagValue* parsed_value,
                                  FlagSettingMode set_mode,
-                                 string* msg) {
+                                 string* msg, string* error) {
+  if (undo_log_ != NULL)
+    SaveToUndoLogLocked(flag);
   flag->UpdateModifiedBit();
   switch (set_mode) {
     case SET_FLAGS_VALUE: {
       // set or modify the flag's value
-      if (!TryParseLocked(flag, flag->current_, value, msg))
+      if (!TryAssignLocked(flag, flag->current_, value, parsed_value,
+                           msg, error))
         return false;
       flag->modified_ = true;
       break;
@@ -867,10 +1333,11 @@ bool FlagRegistry::SetFlagLocked(CommandLineFlag* flag,
     case SET_FLAG_IF_DEFAULT: {
       // set the flag's value, but only if it hasn't been set by someone else
       if (!flag->modified_) {
-        if (!TryParseLocked(flag, flag->current_, value, msg))
+        if (!TryAssignLocked(flag, flag->current_, value, parsed_value,
+                             msg, error))
           return false;
         flag->modified_ = true;
-      } else {
+      } else if (msg) {
         *msg = StringPrintf("%s set to %s",
                             flag->name(), flag->current_value().c_str());
       }
@@ -878,11 +1345,12 @@ bool FlagRegistry::SetFlagLocked(CommandLineFlag* flag,
     }
     case SET_FLAGS_DEFAULT: {
       // modify the flag's default-value
-      if (!TryParseLocked(flag, flag->defvalue_, value, msg))
+      if (!TryAssignLocked(flag, flag->defvalue_, value, parsed_value,
+                           msg, error))
         return false;
       if (!flag->modified_) {
         // Need to set both defvalue *and* current, in this case
-        TryParseLocked(flag, flag->current_, value, NULL);
+        TryAssignLocked(flag, flag->current_, value, parsed_value, NULL, NULL);
       }
       break;
     }
@@ -900,14 +1368,105 @@ bool FlagRegistry::SetFlagLocked(CommandLineFlag* flag,
 FlagRegistry* FlagRegistry::global_registry_ = NULL;
 
 FlagRegistry* FlagRegistry::GlobalRegistry() {
+#ifdef GMUTEX_ATOMIC_POINTER
+  // Once created, the registry is never replaced (short of
+  // ShutDownCommandLineFlags(), which is thread-hostile anyway), so
+  // the lock below is only needed until somebody has created it.
+  FlagRegistry* const registry = AcquireLoad(&global_registry_);
+  if (registry != NULL) return registry;
+#endif
   static Mutex lock(Mutex::LINKER_INITIALIZED);
   MutexLock acquire_lock(&lock);
   if (!global_registry_) {
+#ifdef GMUTEX_ATOMIC_POINTER
+    ReleaseStore(&global_registry_, new FlagRegistry);
+#else
     global_registry_ = new FlagRegistry;
+#endif
   }
   return global_registry_;
 }
 
+// --------------------------------------------------------------------
+// RunInParallel()
+//    Runs a number of independent tasks on several threads at once.
+//    We use this for work which we can do without holding the
+//    registry lock, such as reading flagfiles.
+// --------------------------------------------------------------------
+
+struct ParallelTasks {
+  void (*fn)(void* arg, size_t task);
+  void* arg;
+  size_t num_tasks;
+  Mutex lock;              // protects next_task
+  size_t next_task;
+};
+
+// Runs tasks until there are none left to start.
+static void RunParallelTasks(ParallelTasks* tasks) {
+  for (;;) {
+    size_t task;
+    {
+      MutexLock l(&tasks->lock);
+      if (tasks->next_task == tasks->num_tasks) return;
+      task = tasks->next_task++;
+    }
+    tasks->fn(tasks->arg, task);
+  }
+}
+
+#if defined(OS_WINDOWS) && !defined(NO_THREADS)
+static DWORD WINAPI ParallelTasksThread(LPVOID tasks) {
+  RunParallelTasks(static_cast<ParallelTasks*>(tasks));
+  return 0;
+}
+#elif defined(HAVE_PTHREAD) && !defined(NO_THREADS)
+static void* ParallelTasksThread(void* tasks) {
+  RunParallelTasks(static_cast<ParallelTasks*>(tasks));
+  return NULL;
+}
+#endif
+
+// Calls fn(arg, task) for every task in [0, num_tasks), on up to
+// max_threads threads including this one, and returns once all calls
+// have returned.  If we can't start threads, we make the calls one
+// after the other.
+static void RunInParallel(size_t num_tasks, size_t max_threads,
+                          void (*fn)(void* arg, size_t task), void* arg) {
+  ParallelTasks tasks;
+  tasks.fn = fn;
+  tasks.arg = arg;
+  tasks.num_tasks = num_tasks;
+  tasks.next_task = 0;
+  const size_t num_threads = std::min(num_tasks, max_threads);
+#if defined(OS_WINDOWS) && !defined(NO_THREADS)
+  vector<HANDLE> threads;
+  for (size_t i = 1; i < num_threads; ++i) {
+    const HANDLE thread =
+        CreateThread(NULL, 0, &ParallelTasksThread, &tasks, 0, NULL);
+    if (thread != NULL) threads.push_back(thread);
+  }
+  RunParallelTasks(&tasks);
+  for (size_t i = 0; i < threads.size(); ++i) {
+    WaitForSingleObject(threads[i], INFINITE);
+    CloseHandle(threads[i]);
+  }
+#elif defined(HAVE_PTHREAD) && !defined(NO_THREADS)
+  vector<pthread_t> threads;
+  for (size_t i = 1; i < num_threads; ++i) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, &ParallelTasksThread, &tasks) == 0)
+      threads.push_back(thread);
+  }
+  RunParallelTasks(&tasks);
+  for (size_t i = 0; i < threads.size(); ++i)
+    pthread_join(threads[i], NULL);
+#else
+  (void)num_threads;
+  RunParallelTasks(&tasks);
+#endif
+}
+
 // --------------------------------------------------------------------
 // CommandLineFlagParser
 //    Parsing is done in two stages.  In the first, we go through
@@ -923,11 +1482,32 @@ FlagRegistry* FlagRegistry::GlobalRegistry() {
 //    is handled as soon as it's seen in stage 1, not in stage 2.
 // --------------------------------------------------------------------
 
+class FlagfileContents;
+
 class CommandLineFlagParser {
  public:
   // The argument is the flag-registry to register the parsed flags in
-  explicit CommandLineFlagParser(FlagRegistry* reg) : registry_(reg) {}
-  ~CommandLineFlagParser() {}
+  explicit CommandLineFlagParser(FlagRegistry* reg)
+      : registry_(reg), describe_new_values_(false),
+        deduplicate_assignments_(false), validate_in_parallel_(false) {}
+  ~CommandLineFlagParser();
+
+  // Makes the Process*Locked() functions below return a description
+  // of the flag values they set.  By default they return empty strings
+  // on success as well, since most callers ignore the description, and
+  // for a large flagfile, building it can take as much memory as the
+  // flagfile itself.
+  void DescribeNewValues() { describe_new_values_ = true; }
+
+  // Makes ProcessSingleOptionLocked() and friends only remember the value
+  // of each ordinary flag they are asked to set, rather than parsing it.
+  // ParseNewCommandLineFlags() then sets every flag once, to the last of
+  // its values.  --flagfile and the like still take effect immediately.
+  void DeduplicateAssignments() { deduplicate_assignments_ = true; }
+
+  // Makes ValidateFlags() call the validate functions without holding
+  // the registry lock, several at a time, on copies of the flag values.
+  void ValidateInParallel() { validate_in_parallel_ = true; }
 
   // Stage 1: Every time this is called, it reads all flags in argv.
   // However, it ignores all flags that have been successfully set
@@ -948,9 +1528,10 @@ class CommandLineFlagParser {
   bool ReportErrors();
 
   // Set a particular command line option.  "newval" is a string
-  // describing the new value that the option has been set to.  If
-  // option_name does not specify a valid option name, or value is not
-  // a valid value for option_name, newval is empty.  Does recursive
+  // describing the new value that the option has been set to (if we
+  // were asked to DescribeNewValues()).  If option_name does not
+  // specify a valid option name, or value is not a valid value for
+  // option_name, newval is empty.  Does recursive
   // processing for --flagfile and --fromenv.  Returns the new value
   // if everything went ok, or empty-string if not.  (Actually, the
   // return-string could hold many flag/value pairs due to --flagfile.)
@@ -966,19 +1547,103 @@ class CommandLineFlagParser {
   // pairs due to --flagfile.)
   // NB: Must have called registry_->Lock() before calling this function.
   string ProcessOptionsFromStringLocked(const string& contentdata,
+                                        FlagSettingMode set_mode) {
+    return ProcessOptionsFromBufferLocked(contentdata.data(),
+                                          contentdata.size(), set_mode);
+  }
+  // The same for the size bytes at contents, which we parse in place.
+  // Contents end early at a NUL byte, if there is one, unless they are
+  // those of a binary flagfile written by CompileFlagfile().
+  string ProcessOptionsFromBufferLocked(const char* contents, size_t size,
                                         FlagSettingMode set_mode);
 
+  // Reads the flagfiles named in the given --flagfile values, the
+  // flagfiles named by --flagfile lines in those, and so on, several at
+  // a time.  ProcessFlagfileLocked() then takes the contents of these
+  // files from us rather than reading them while it holds the lock.
+  // We don't care whether the --flagfile lines would apply to this
+  // program: reading a file too many does no harm.  We only prefetch
+  // regular files, which can be read again, and leave all errors for
+  // ProcessFlagfileLocked() to report.
+  // NB: Must *not* hold the registry lock when calling this function.
+  void PrefetchFlagfiles(const vector<string>& flagvals);
+
   // These are the 'recursive' flags, defined at the top of this file.
   // Whenever we see these flags on the commandline, we must take action.
   // These are called by ProcessSingleOptionLocked and, similarly, return
   // new values if everything went ok, or the empty-string if not.
   string ProcessFlagfileLocked(const string& flagval, FlagSettingMode set_mode);
-  // diff fromenv/tryfromenv
+  // diff fromenv/tryfromenv.  The flag name "*" stands for all flags
+  // that have a variable in the environment, except the recursive ones.
   string ProcessFromenvLocked(const string& flagval, FlagSettingMode set_mode,
                               bool errors_are_fatal);
 
+  // Makes all the changes of SetCommandLineOptions(), or none of them.
+  // NB: Must have called registry_->Lock() before calling this function.
+  bool SetOptionsLocked(vector<CommandLineOptionUpdate>* updates);
+
  private:
+  // Sets the flag given by the name_and_val line of a flagfile, which
+  // is neither NUL-terminated nor starts with dashes.  value_buffer is
+  // just for reuse from line to line.
+  string ProcessFlagLineLocked(const char* name_and_val, size_t size,
+                               FlagSettingMode set_mode,
+                               string* value_buffer);
+  // The same as ProcessOptionsFromBufferLocked() for a binary flagfile.
+  string ProcessBinaryOptionsLocked(const char* contents, size_t size,
+                                    FlagSettingMode set_mode);
+  // The same as ProcessSingleOptionLocked() for a value which has
+  // already been parsed, and which is not a --flagfile or the like.
+  string ProcessParsedOptionLocked(CommandLineFlag* flag,
+                                   const FlagValue& value,
+                                   FlagSettingMode set_mode);
+  // Sets the flags whose assignment DeduplicateAssignments() deferred.
+  void ApplyDeferredAssignmentsLocked();
+  // Appends every registered flag that has a FLAGS_<name> variable in
+  // the environment to env_flags, with the value of that variable, in
+  // the order of the environment.  env_index maps a flag to its place
+  // in env_flags.  Like getenv(), we take the first of several
+  // definitions of a variable.
+  void ReadEnvironmentLocked(
+      vector<pair<CommandLineFlag*, string> >* env_flags,
+      map<const CommandLineFlag*, size_t>* env_index) const;
+
+  // How to undo one change that SetOptionsLocked() made.
+  struct FlagUndo {
+    CommandLineFlag* flag;
+    bool modified;           // the flag's modified bit before the change
+    FlagValue* flag_value;   // the flag's current or default value
+    FlagValue* old_value;    // what flag_value was before the change
+  };
+
+  // What ValidateFlagsInParallel() knows about each flag it validates,
+  // all taken while it holds the registry lock.
+  struct FlagValidation {
+    const CommandLineFlag* flag;
+    ValidateFnProto validate_fn_proto;
+    FlagValue* value;     // a copy of the current value, which we own
+    bool modified;
+    bool valid;           // the result of validate_fn_proto(value)
+  };
+  // The task run by ValidateFlagsInParallel(): validates one flag.
+  static void RunFlagValidation(void* validations, size_t i);
+  // The same as ValidateFlags() with ValidateInParallel().
+  void ValidateFlagsInParallel(bool all);
+  // Records that flag failed validation, unless it has an error already.
+  void AddValidationError(const CommandLineFlag* flag, bool modified);
+
   FlagRegistry* const registry_;
+  bool describe_new_values_;
+  bool deduplicate_assignments_;
+  bool validate_in_parallel_;
+  // The flags whose assignment we deferred, in the order of their first
+  // assignment, with the last value assigned to each.  deferred_index_
+  // maps a flag to its place in deferred_assignments_.
+  vector<pair<CommandLineFlag*, string> > deferred_assignments_;
+  map<const CommandLineFlag*, size_t> deferred_index_;
+  // The files read by PrefetchFlagfiles(), with NULL for those we
+  // couldn't read.  We own the FlagfileContents.
+  map<string, FlagfileContents*> prefetched_flagfiles_;
   map<string, string> error_flags_;      // map from name to error message
   // This could be a set<string>, but we reuse the map to minimize the .o size
   map<string, string> undefined_names_;  // --[flag] name was not registered
@@ -1012,12 +1677,11 @@ static void ParseFlagList(const char* value, vector<string>* flags) {
 // Adds a newline at the end of the file.
 #define PFATAL(s)  do { perror(s); gflags_exitfunc(1); } while (0)
 
-static string ReadFileIntoString(const char* filename) {
+// Reads all of fp, which was opened from filename, and closes it.
+static string ReadFileIntoString(FILE* fp, const char* filename) {
   const int kBufSize = 8092;
   char buffer[kBufSize];
   string s;
-  FILE* fp;
-  if ((errno = SafeFOpen(&fp, filename, "r")) != 0) PFATAL(filename);
   size_t n;
   while ( (n=fread(buffer, 1, kBufSize, fp)) > 0 ) {
     if (ferror(fp))  PFATAL(filename);
@@ -1027,58 +1691,165 @@ static string ReadFileIntoString(const char* filename) {
   return s;
 }
 
+// The contents of a flagfile, for as long as this object lives.  Where
+// we can, we map regular files into memory rather than reading them,
+// which saves us from copying the file into a (repeatedly reallocated)
+// string, and keeps its pages out of our heap.  But if another process
+// truncates a mapped file while we parse it, touching the pages past
+// the new end raises SIGBUS, where a read would just have come up
+// short.  Config pushers often rewrite flagfiles in place, so we only
+// map files that nobody has permission to write.  For everything else,
+// e.g. writable files, pipes, or files in /proc which claim to be
+// empty, we fall back to reading the file.
+class FlagfileContents {
+ public:
+  FlagfileContents() : mapped_(NULL), data_(NULL), size_(0) { }
+  // Loads filename, and dies if we can't open it.
+  explicit FlagfileContents(const char* filename)
+      : mapped_(NULL), data_(NULL), size_(0) {
+    if (!Load(filename, false)) PFATAL(filename);
+  }
+  ~FlagfileContents();
+
+  // Loads filename into this (empty) object.  Returns false, with errno
+  // set, if we can't open it.  If regular_only, we also return false for
+  // files that aren't regular files, so as not to consume the data of
+  // a pipe or the like which somebody else might want to read later.
+  bool Load(const char* filename, bool regular_only);
+
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  void* mapped_;       // the mapping, or NULL if we read into buffer_
+  string buffer_;
+  const char* data_;
+  size_t size_;
+
+  FlagfileContents(const FlagfileContents&);  // no copying!
+  void operator=(const FlagfileContents&);
+};
+
+bool FlagfileContents::Load(const char* filename, bool regular_only) {
+  assert(data_ == NULL);
+#ifdef HAVE_MMAP_FLAGFILES
+  // Other threads may fork while we read, e.g. during PrefetchFlagfiles().
+  const int fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return false;
+  struct stat st;
+  const bool regular = (fstat(fd, &st) == 0 && S_ISREG(st.st_mode));
+  if (regular && (st.st_mode & (S_IWUSR | S_IWGRP | S_IWOTH)) == 0 &&
+      st.st_size > 0 &&
+      static_cast<uint64>(st.st_size) <= static_cast<size_t>(-1)) {
+    const size_t size = static_cast<size_t>(st.st_size);
+    void* const mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped != MAP_FAILED) {
+      mapped_ = mapped;
+      data_ = static_cast<const char*>(mapped);
+      size_ = size;
+    }
+  }
+  if (mapped_ != NULL || (regular_only && !regular)) {
+    close(fd);
+    return mapped_ != NULL;
+  }
+  // Read from the file we already opened: opening a FIFO again would
+  // wait for another writer.
+  FILE* const fp = fdopen(fd, "r");
+  if (fp == NULL) {
+    close(fd);
+    return false;
+  }
+#else
+  if (regular_only) return false;
+  FILE* fp;
+  if ((errno = SafeFOpen(&fp, filename, "r")) != 0) return false;
+#endif
+  buffer_ = ReadFileIntoString(fp, filename);
+  data_ = buffer_.data();
+  size_ = buffer_.size();
+  return true;
+}
+
+FlagfileContents::~FlagfileContents() {
+#ifdef HAVE_MMAP_FLAGFILES
+  if (mapped_ != NULL)
+    munmap(mapped_, size_);
+#endif
+}
+
+CommandLineFlagParser::~CommandLineFlagParser() {
+  for (map<string, FlagfileContents*>::iterator it =
+           prefetched_flagfiles_.begin();
+       it != prefetched_flagfiles_.end(); ++it) {
+    delete it->second;
+  }
+}
+
 uint32 CommandLineFlagParser::ParseNewCommandLineFlags(int* argc, char*** argv,
                                                        bool remove_flags) {
-  int first_nonopt = *argc;        // for non-options moved to the end
+  // Like getopt(), we permute non-option flags to be at the end, keeping
+  // their order.  Options are moved down over the gaps as we go, and the
+  // non-options are put back behind them once we are done, so this takes
+  // linear time however many arguments there are.
+  char** const args = *argv;
+  const int num_args = *argc;
+  vector<char*> nonopts;           // in the order we found them
+  int first_nonopt = 1;            // where the next option goes
+  int first_unparsed = num_args;   // set to what follows "--", if any
 
   registry_->Lock();
-  for (int i = 1; i < first_nonopt; i++) {
-    char* arg = (*argv)[i];
+  for (int i = 1; i < num_args; i++) {
+    char* arg = args[i];
 
-    // Like getopt(), we permute non-option flags to be at the end.
     if (arg[0] != '-' || arg[1] == '\0') {	// must be a program argument: "-" is an argument, not a flag
-      memmove((*argv) + i, (*argv) + i+1, (*argc - (i+1)) * sizeof((*argv)[i]));
-      (*argv)[*argc-1] = arg;      // we go last
-      first_nonopt--;              // we've been pushed onto the stack
-      i--;                         // to undo the i++ in the loop
+      nonopts.push_back(arg);
       continue;
     }
+    args[first_nonopt++] = arg;
     arg++;                     // skip leading '-'
     if (arg[0] == '-') arg++;  // or leading '--'
 
     // -- alone means what it does for GNU: stop options parsing
     if (*arg == '\0') {
-      first_nonopt = i+1;
+      first_unparsed = i+1;
       break;
     }
 
-    // Find the flag object for this option
-    string key;
+    // Find the flag object for this option.  We only copy the name of
+    // the flag if we have to report an error, so that parsing a known
+    // flag allocates no memory before we set it.
+    const char* key;
+    size_t key_len;
     const char* value;
+    size_t value_len;
     string error_message;
-    CommandLineFlag* flag = registry_->SplitArgumentLocked(arg, &key, &value,
-                                                           &error_message);
+    CommandLineFlag* flag = registry_->SplitArgumentLocked(
+        arg, strlen(arg), &key, &key_len, &value, &value_len, &error_message);
     if (flag == NULL) {
-      undefined_names_[key] = "";    // value isn't actually used
-      error_flags_[key] = error_message;
+      const string key_string(key, key_len);
+      undefined_names_[key_string] = "";    // value isn't actually used
+      error_flags_[key_string] = error_message;
       continue;
     }
 
     if (value == NULL) {
       // Boolean options are always assigned a value by SplitArgumentLocked()
       assert(flag->Type() != FlagValue::FV_BOOL);
-      if (i+1 >= first_nonopt) {
+      if (i+1 >= num_args) {
         // This flag needs a value, but there is nothing available
-        error_flags_[key] = (string(kError) + "flag '" + (*argv)[i] + "'"
-                             + " is missing its argument");
+        string& error = error_flags_[string(key, key_len)];
+        error = (string(kError) + "flag '" + args[i] + "'"
+                 + " is missing its argument");
         if (flag->help() && flag->help()[0] > '\001') {
           // Be useful in case we have a non-stripped description.
-          error_flags_[key] += string("; flag description: ") + flag->help();
+          error += string("; flag description: ") + flag->help();
         }
-        error_flags_[key] += "\n";
+        error += "\n";
         break;    // we treat this as an unrecoverable error
       } else {
-        value = (*argv)[++i];                   // read next arg for value
+        value = args[++i];                      // read next arg for value
+        args[first_nonopt++] = args[i];
 
         // Heuristic to detect the case where someone treats a string arg
         // like a bool:
@@ -1101,11 +1872,20 @@ uint32 CommandLineFlagParser::ParseNewCommandLineFlags(int* argc, char*** argv,
       }
     }
 
-    // TODO(csilvers): only set a flag if we hadn't set it before here
     ProcessSingleOptionLocked(flag, value, SET_FLAGS_VALUE);
   }
+  ApplyDeferredAssignmentsLocked();
   registry_->Unlock();
 
+  // What follows "--" stays where it is, ahead of the non-options we
+  // moved out of the way.
+  int next = first_nonopt;
+  for (int i = first_unparsed; i < num_args; i++)
+    args[next++] = args[i];
+  for (size_t i = 0; i < nonopts.size(); i++)
+    args[next++] = nonopts[i];
+  assert(next == num_args);
+
   if (remove_flags) {   // Fix up argc and argv by removing command line flags
     (*argv)[first_nonopt-1] = (*argv)[0];
     (*argv) += (first_nonopt-1);
@@ -1128,11 +1908,52 @@ string CommandLineFlagParser::ProcessFlagfileLocked(const string& flagval,
   ParseFlagList(flagval.c_str(), &filename_list);  // take a list of filenames
   for (size_t i = 0; i < filename_list.size(); ++i) {
     const char* file = filename_list[i].c_str();
-    msg += ProcessOptionsFromStringLocked(ReadFileIntoString(file), set_mode);
+    const map<string, FlagfileContents*>::const_iterator prefetched =
+        prefetched_flagfiles_.find(filename_list[i]);
+    if (prefetched != prefetched_flagfiles_.end() &&
+        prefetched->second != NULL) {
+      msg += ProcessOptionsFromBufferLocked(prefetched->second->data(),
+                                            prefetched->second->size(),
+                                            set_mode);
+    } else {
+      const FlagfileContents contents(file);
+      msg += ProcessOptionsFromBufferLocked(contents.data(), contents.size(),
+                                            set_mode);
+    }
   }
   return msg;
 }
 
+// Returns true for the flags which make us read more flags.
+static bool IsRecursiveFlag(const CommandLineFlag* flag) {
+  return strcmp(flag->name(), "flagfile") == 0 ||
+         strcmp(flag->name(), "fromenv") == 0 ||
+         strcmp(flag->name(), "tryfromenv") == 0;
+}
+
+void CommandLineFlagParser::ReadEnvironmentLocked(
+    vector<pair<CommandLineFlag*, string> >* env_flags,
+    map<const CommandLineFlag*, size_t>* env_index) const {
+  static const char kPrefix[] = "FLAGS_";
+  static const size_t kPrefixLen = sizeof(kPrefix) - 1;
+  for (char** env = environ; env != NULL && *env != NULL; ++env) {
+    if (strncmp(*env, kPrefix, kPrefixLen) != 0) continue;
+    const char* const name = *env + kPrefixLen;
+    const char* const value = strchr(name, '=');
+    if (value == NULL) continue;
+    // Unlike FindFlagLocked(name), this doesn't turn dashes into
+    // underscores, just as getenv() wouldn't.
+    const size_t len = value - name;
+    CommandLineFlag* const flag =
+        registry_->FindFlagLocked(name, len, FlagNameHash(name, len));
+    if (flag == NULL) continue;
+    const pair<const CommandLineFlag*, size_t> index_entry(
+        flag, env_flags->size());
+    if (env_index->insert(index_entry).second)
+      env_flags->push_back(pair<CommandLineFlag*, string>(flag, value + 1));
+  }
+}
+
 string CommandLineFlagParser::ProcessFromenvLocked(const string& flagval,
                                                    FlagSettingMode set_mode,
                                                    bool errors_are_fatal) {
@@ -1143,8 +1964,26 @@ string CommandLineFlagParser::ProcessFromenvLocked(const string& flagval,
   vector<string> flaglist;
   ParseFlagList(flagval.c_str(), &flaglist);
 
+  // Each getenv() would scan the whole environment, so we scan it once
+  // for all the flags.
+  vector<pair<CommandLineFlag*, string> > env_flags;
+  map<const CommandLineFlag*, size_t> env_index;
+  ReadEnvironmentLocked(&env_flags, &env_index);
+
   for (size_t i = 0; i < flaglist.size(); ++i) {
     const char* flagname = flaglist[i].c_str();
+    if (flaglist[i] == "*") {
+      // Setting --flagfile and the like from the environment must be
+      // asked for by name, which also rules out infinite recursion.
+      for (size_t j = 0; j < env_flags.size(); ++j) {
+        if (!IsRecursiveFlag(env_flags[j].first))
+          msg += ProcessSingleOptionLocked(env_flags[j].first,
+                                           env_flags[j].second.c_str(),
+                                           set_mode);
+      }
+      continue;
+    }
+
     CommandLineFlag* flag = registry_->FindFlagLocked(flagname);
     if (flag == NULL) {
       error_flags_[flagname] =
@@ -1155,11 +1994,21 @@ string CommandLineFlagParser::ProcessFromenvLocked(const string& flagval,
       continue;
     }
 
-    const string envname = string("FLAGS_") + string(flagname);
+    // The variable is FLAGS_<flagname> as given, even if that differs
+    // from the flag's name by dashes.  Only getenv() can find those.
     string envval;
-    if (!SafeGetEnv(envname.c_str(), envval)) {
+    bool found;
+    if (strcmp(flagname, flag->name()) == 0) {
+      const map<const CommandLineFlag*, size_t>::const_iterator env =
+          env_index.find(flag);
+      found = (env != env_index.end());
+      if (found) envval = env_flags[env->second].second;
+    } else {
+      found = SafeGetEnv(("FLAGS_" + flaglist[i]).c_str(), envval);
+    }
+    if (!found) {
       if (errors_are_fatal) {
-        error_flags_[flagname] = (string(kError) + envname +
+        error_flags_[flagname] = (string(kError) + "FLAGS_" + flagname +
                                   " not found in environment\n");
       }
       continue;
@@ -1180,9 +2029,26 @@ string CommandLineFlagParser::ProcessFromenvLocked(const string& flagval,
 
 string CommandLineFlagParser::ProcessSingleOptionLocked(
     CommandLineFlag* flag, const char* value, FlagSettingMode set_mode) {
-  string msg;
-  if (value && !registry_->SetFlagLocked(flag, value, set_mode, &msg)) {
-    error_flags_[flag->name()] = msg;
+  if (value && deduplicate_assignments_ && set_mode == SET_FLAGS_VALUE &&
+      !IsRecursiveFlag(flag)) {
+    const pair<const CommandLineFlag*, size_t> index_entry(
+        flag, deferred_assignments_.size());
+    const pair<map<const CommandLineFlag*, size_t>::iterator, bool> entry =
+        deferred_index_.insert(index_entry);
+    if (entry.second)
+      deferred_assignments_.push_back(
+          pair<CommandLineFlag*, string>(flag, string()));
+    else
+      ++num_skipped_flag_assignments;   // a later value wins
+    deferred_assignments_[entry.first->second].second = value;
+    return "";
+  }
+
+  string msg, error;
+  if (value && !registry_->SetFlagLocked(flag, value, set_mode,
+                                         describe_new_values_ ? &msg : NULL,
+                                         &error)) {
+    error_flags_[flag->name()] = error;
     return "";
   }
 
@@ -1203,25 +2069,164 @@ string CommandLineFlagParser::ProcessSingleOptionLocked(
   return msg;
 }
 
+bool CommandLineFlagParser::SetOptionsLocked(
+    vector<CommandLineOptionUpdate>* updates) {
+  // First we look up all the flags and parse all the values, so that we
+  // don't change any flag unless they are all fine.
+  bool ok = true;
+  vector<CommandLineFlag*> flags(updates->size(), NULL);
+  vector<FlagValue*> values(updates->size(), NULL);
+  for (size_t i = 0; i < updates->size(); ++i) {
+    CommandLineOptionUpdate& update = (*updates)[i];
+    update.result.clear();
+    update.error.clear();
+    CommandLineFlag* const flag =
+        registry_->FindFlagLocked(update.name.c_str());
+    if (flag == NULL) {
+      update.error = StringPrintf("%sunknown command line flag '%s'\n",
+                                  kError, update.name.c_str());
+      ok = false;
+    } else if (IsRecursiveFlag(flag)) {
+      update.error = StringPrintf("%sflag '%s' can only be set by itself\n",
+                                  kError, flag->name());
+      ok = false;
+    } else {
+      flags[i] = flag;
+      values[i] = flag->current_->New();
+      if (!values[i]->ParseFrom(update.value.c_str())) {
+        update.error = StringPrintf(
+            "%sillegal value '%s' specified for %s flag '%s'\n",
+            kError, update.value.c_str(), flag->type_name(), flag->name());
+        ok = false;
+      }
+    }
+  }
+
+  // Then we make the changes in order, as SetFlagLocked() would.  But
+  // rather than copying the new values into the flags, we swap them
+  // in, which leaves us the old values to restore if a later value
+  // fails validation.
+  vector<FlagUndo> undo_log;
+  for (size_t i = 0; ok && i < updates->size(); ++i) {
+    CommandLineOptionUpdate& update = (*updates)[i];
+    CommandLineFlag* const flag = flags[i];
+    flag->UpdateModifiedBit();
+    FlagUndo undo = { flag, flag->modified_, NULL, NULL };
+    if (update.set_mode == SET_FLAG_IF_DEFAULT && flag->modified_) {
+      update.result = StringPrintf("%s set to %s",
+                                   flag->name(), flag->current_value().c_str());
+      continue;
+    }
+    if (!ValidateNewValueLocked(flag, *values[i], &update.error)) {
+      ok = false;
+      break;
+    }
+    if (update.set_mode == SET_FLAGS_DEFAULT) {
+      if (!flag->modified_) {
+        // Need to set both defvalue *and* current, in this case
+        undo.flag_value = flag->current_;
+        undo.old_value = values[i]->New();
+        undo.old_value->CopyFrom(*values[i]);
+        values.push_back(undo.old_value);     // so that we delete it
+        flag->current_->SwapWith(undo.old_value);
+        undo_log.push_back(undo);
+      }
+      undo.flag_value = flag->defvalue_;
+    } else {
+      undo.flag_value = flag->current_;
+      flag->modified_ = true;
+    }
+    undo.old_value = values[i];
+    undo.flag_value->SwapWith(undo.old_value);
+    undo_log.push_back(undo);
+    DescribeNewValueLocked(flag, *undo.flag_value, &update.result);
+  }
+  if (!ok) {
+    for (size_t i = undo_log.size(); i-- > 0; ) {
+      undo_log[i].flag_value->SwapWith(undo_log[i].old_value);
+      undo_log[i].flag->modified_ = undo_log[i].modified;
+    }
+    for (size_t i = 0; i < updates->size(); ++i)
+      (*updates)[i].result.clear();
+  }
+  for (size_t i = 0; i < values.size(); ++i)
+    delete values[i];
+  return ok;
+}
+
+void CommandLineFlagParser::AddValidationError(const CommandLineFlag* flag,
+                                               bool modified) {
+  // only set a message if one isn't already there.  (If there's
+  // an error message, our job is done, even if it's not exactly
+  // the same error.)
+  string& error = error_flags_[flag->name()];
+  if (error.empty()) {
+    error = string(kError) + "--" + flag->name() +
+            " must be set on the commandline";
+    if (!modified) {
+      error += " (default value fails validation)";
+    }
+    error += "\n";
+  }
+}
+
 void CommandLineFlagParser::ValidateFlags(bool all) {
+  if (validate_in_parallel_) {
+    ValidateFlagsInParallel(all);
+    return;
+  }
   FlagRegistryLock frl(registry_);
-  for (FlagRegistry::FlagConstIterator i = registry_->flags_.begin();
-       i != registry_->flags_.end(); ++i) {
-    if ((all || !i->second->Modified()) && !i->second->ValidateCurrent()) {
-      // only set a message if one isn't already there.  (If there's
-      // an error message, our job is done, even if it's not exactly
-      // the same error.)
-      if (error_flags_[i->second->name()].empty()) {
-        error_flags_[i->second->name()] =
-            string(kError) + "--" + i->second->name() +
-            " must be set on the commandline";
-        if (!i->second->Modified()) {
-          error_flags_[i->second->name()] += " (default value fails validation)";
-        }
-        error_flags_[i->second->name()] += "\n";
-      }
+  // Only flags that have a validate function can fail validation.
+  const FlagRegistry::FlagList& flags = registry_->flags_with_validators_;
+  for (FlagRegistry::FlagConstIterator i = flags.begin();
+       i != flags.end(); ++i) {
+    const CommandLineFlag* flag = *i;
+    if ((all || !flag->Modified()) && !flag->ValidateCurrent())
+      AddValidationError(flag, flag->Modified());
+  }
+}
+
+void CommandLineFlagParser::RunFlagValidation(void* validations, size_t i) {
+  FlagValidation* const validation =
+      &(*static_cast<vector<FlagValidation>*>(validations))[i];
+  validation->valid = validation->value->Validate(
+      validation->flag->name(), validation->validate_fn_proto);
+}
+
+void CommandLineFlagParser::ValidateFlagsInParallel(bool all) {
+  // The number of validators we run at once.
+  static const size_t kMaxThreads = 8;
+
+  vector<FlagValidation> validations;
+  {
+    FlagRegistryLock frl(registry_);
+    const FlagRegistry::FlagList& flags = registry_->flags_with_validators_;
+    for (FlagRegistry::FlagConstIterator i = flags.begin();
+         i != flags.end(); ++i) {
+      const CommandLineFlag* flag = *i;
+      if (flag->validate_function() == NULL || (!all && flag->Modified()))
+        continue;
+      FlagValidation validation;
+      validation.flag = flag;
+      validation.validate_fn_proto = flag->validate_function();
+      validation.value = flag->current_->New();
+      validation.value->CopyFrom(*flag->current_);
+      validation.modified = flag->Modified();
+      validation.valid = true;
+      validations.push_back(validation);
     }
   }
+  // Validators may take long, e.g. to look at files, and they don't
+  // depend on each other, so we run them all at once.  We record the
+  // errors in the order of the flags, not in the order the validators
+  // finish, so that we report the same errors every time.
+  RunInParallel(validations.size(), kMaxThreads,
+                &RunFlagValidation, &validations);
+  for (size_t i = 0; i < validations.size(); ++i) {
+    if (!validations[i].valid)
+      AddValidationError(validations[i].flag, validations[i].modified);
+    delete validations[i].value;
+  }
 }
 
 void CommandLineFlagParser::ValidateUnmodifiedFlags() {
@@ -1267,94 +2272,565 @@ bool CommandLineFlagParser::ReportErrors() {
   return found_error;
 }
 
-string CommandLineFlagParser::ProcessOptionsFromStringLocked(
-    const string& contentdata, FlagSettingMode set_mode) {
-  string line, retval;
-  const char* flagfile_contents = contentdata.c_str();
-  bool flags_are_relevant = true;   // set to false when filenames don't match
-  bool in_filename_section = false;
-
-  // We read this file a line at a time.
-  while (flagfile_contents) {
-    while (*flagfile_contents && isspace(*flagfile_contents))
-      ++flagfile_contents;
-    // Windows uses "\r\n"
-    const char* line_end = strchr(flagfile_contents, '\r');
-    if (line_end == NULL)
-        line_end = strchr(flagfile_contents, '\n');
-    if (line_end == NULL) {
-      line.assign(flagfile_contents, strlen(flagfile_contents));
-    } else {
-      line.assign(flagfile_contents, line_end - flagfile_contents);
-      line_end += 1;
-    }
-    flagfile_contents = line_end;
+// Returns the first occurrence of c in [begin, end), or end if there is
+// none.  memchr() is usually vectorized, unlike a loop of our own.
+static const char* FindCharOrEnd(const char* begin, const char* end, char c) {
+  const void* const found = memchr(begin, c, end - begin);
+  return found ? static_cast<const char*>(found) : end;
+}
 
-    // Each line can be one of four things:
-    // 1) A comment line -- we skip it
-    // 2) An empty line -- we skip it
-    // 3) A list of filenames -- starts a new filenames+flags section
-    // 4) A --flag=value line -- apply if previous filenames match
-    if (line.empty() || line[0] == '#') {
-      // comment or empty line; just ignore
+// Returns true if str equals the len characters at view, which need not
+// be NUL-terminated.
+static bool EqualsView(const char* str, const char* view, size_t len) {
+  return strlen(str) == len && memcmp(str, view, len) == 0;
+}
 
-    } else if (line[0] == '-') {    // flag
-      in_filename_section = false;  // instead, it was a flag-line
-      if (!flags_are_relevant)      // skip this flag; applies to someone else
-        continue;
+// Splits flagfile contents into lines, which end at "\n", or at "\r"
+// (Windows uses "\r\n").  We remember where the next of each of these
+// is, and only search again once we have moved past it, so that we look
+// at every byte at most once per delimiter no matter how many lines
+// there are.
+class FlagfileLines {
+ public:
+  FlagfileLines(const char* contents, const char* contents_end)
+      : next_(contents), end_(contents_end),
+        next_cr_(FindCharOrEnd(contents, contents_end, '\r')),
+        next_lf_(FindCharOrEnd(contents, contents_end, '\n')) { }
+
+  // Points [*line, *line_end) at the next line, without its leading
+  // whitespace, and returns true; or returns false at the end.
+  bool Next(const char** line, const char** line_end) {
+    if (next_ == end_) return false;
+    while (next_ != end_ && isspace(*next_))
+      ++next_;
+    if (next_cr_ < next_)
+      next_cr_ = FindCharOrEnd(next_, end_, '\r');
+    if (next_lf_ < next_)
+      next_lf_ = FindCharOrEnd(next_, end_, '\n');
+    *line = next_;
+    *line_end = std::min(next_cr_, next_lf_);
+    next_ = (*line_end == end_) ? *line_end : *line_end + 1;
+    return true;
+  }
 
-      const char* name_and_val = line.c_str() + 1;    // skip the leading -
-      if (*name_and_val == '-')
-        name_and_val++;                               // skip second - too
-      string key;
-      const char* value;
-      string error_message;
-      CommandLineFlag* flag = registry_->SplitArgumentLocked(name_and_val,
-                                                             &key, &value,
-                                                             &error_message);
-      // By API, errors parsing flagfile lines are silently ignored.
-      if (flag == NULL) {
-        // "WARNING: flagname '" + key + "' not found\n"
-      } else if (value == NULL) {
-        // "WARNING: flagname '" + key + "' missing a value\n"
-      } else {
-        retval += ProcessSingleOptionLocked(flag, value, set_mode);
-      }
+ private:
+  const char* next_;
+  const char* const end_;
+  const char* next_cr_;
+  const char* next_lf_;
+};
 
-    } else {                        // a filename!
-      if (!in_filename_section) {   // start over: assume filenames don't match
-        in_filename_section = true;
-        flags_are_relevant = false;
-      }
+#if defined(HAVE_FNMATCH_H)
+// Returns true if the glob pattern of the given length has none of the
+// characters that fnmatch() treats specially, so that it only matches
+// itself.  PathMatchSpec() gets no such shortcut, because it ignores
+// case and so "MyTool.exe" matches "mytool.exe".
+static bool IsLiteralGlob(const char* glob, size_t glob_len) {
+  for (size_t i = 0; i < glob_len; ++i) {
+    switch (glob[i]) {
+      case '*': case '?': case '[': case '\\':
+        return false;
+    }
+  }
+  return true;
+}
+#endif
 
-      // Split the line up at spaces into glob-patterns
-      const char* space = line.c_str();   // just has to be non-NULL
-      for (const char* word = line.c_str(); *space; word = space+1) {
-        if (flags_are_relevant)     // we can stop as soon as we match
-          break;
-        space = strchr(word, ' ');
-        if (space == NULL)
-          space = word + strlen(word);
-        const string glob(word, space - word);
-        // We try matching both against the full argv0 and basename(argv0)
-        if (glob == ProgramInvocationName()       // small optimization
-            || glob == ProgramInvocationShortName()
+// Returns true if one of the space-separated glob patterns on a
+// filenames line of a flagfile matches this program.  glob_buffer is
+// just for reuse from line to line.
+static bool GlobsMatchProgram(const char* line, const char* line_end,
+                              string* glob_buffer) {
+  const char* space = line;     // just has to be other than line_end
+  for (const char* word = line; space != line_end; word = space+1) {
+    space = FindCharOrEnd(word, line_end, ' ');
+    const size_t glob_len = space - word;
+    // We try matching both against the full argv0 and basename(argv0)
+    if (EqualsView(ProgramInvocationName(), word, glob_len)  // small optimization
+        || EqualsView(ProgramInvocationShortName(), word, glob_len)) {
+      return true;
+    }
 #if defined(HAVE_FNMATCH_H)
-            || fnmatch(glob.c_str(), ProgramInvocationName(),      FNM_PATHNAME) == 0
-            || fnmatch(glob.c_str(), ProgramInvocationShortName(), FNM_PATHNAME) == 0
+    if (IsLiteralGlob(word, glob_len))    // so it didn't match above
+      continue;
+    glob_buffer->assign(word, glob_len);
+    if (fnmatch(glob_buffer->c_str(), ProgramInvocationName(),      FNM_PATHNAME) == 0
+        || fnmatch(glob_buffer->c_str(), ProgramInvocationShortName(), FNM_PATHNAME) == 0) {
+      return true;
+    }
 #elif defined(HAVE_SHLWAPI_H)
-            || PathMatchSpecA(glob.c_str(), ProgramInvocationName())
-            || PathMatchSpecA(glob.c_str(), ProgramInvocationShortName())
+    glob_buffer->assign(word, glob_len);
+    if (PathMatchSpecA(glob_buffer->c_str(), ProgramInvocationName())
+        || PathMatchSpecA(glob_buffer->c_str(), ProgramInvocationShortName())) {
+      return true;
+    }
+#else
+    (void)glob_buffer;
 #endif
-            ) {
-          flags_are_relevant = true;
-        }
+  }
+  return false;
+}
+
+// Whether each filenames line we have seen matches this program, for
+// the program name in filenames_matches_argv0.  Shared flagfiles often
+// have a section for each of many programs, and get read by the same
+// program more than once.  Protected by the lock of the global registry.
+static map<string, bool> filenames_matches;
+static string filenames_matches_argv0;
+
+// Like GlobsMatchProgram(), but only looks at the patterns the first
+// time it sees a line.  Must hold the lock of the global registry.
+static bool FilenamesMatchProgram(const char* line, const char* line_end,
+                                  string* glob_buffer) {
+  // The most lines we remember, to bound the memory we use for them.
+  static const size_t kMaxFilenamesMatches = 4096;
+
+  // SetArgv() changes the program name once, from "UNKNOWN" to argv[0].
+  if (filenames_matches_argv0 != ProgramInvocationName()) {
+    filenames_matches.clear();
+    filenames_matches_argv0 = ProgramInvocationName();
+  }
+  glob_buffer->assign(line, line_end - line);
+  const map<string, bool>::const_iterator it =
+      filenames_matches.find(*glob_buffer);
+  if (it != filenames_matches.end())
+    return it->second;
+  const bool matches = GlobsMatchProgram(line, line_end, glob_buffer);
+  if (filenames_matches.size() < kMaxFilenamesMatches) {
+    const pair<string, bool> entry(string(line, line_end - line), matches);
+    filenames_matches.insert(entry);
+  }
+  return matches;
+}
+
+// --------------------------------------------------------------------
+// Binary flagfiles
+//    CompileFlagfile() turns a text flagfile into a binary one, which
+//    holds the same lines in a form that we can apply without parsing
+//    any text: a header, followed by one fixed-size record per flag or
+//    filenames line, followed by the text of these lines.  Flag records
+//    carry the hash of the flag name for FindFlagLocked(), and the value
+//    already parsed into every numeric type it is valid for, so that we
+//    only need to pick the one of the flag's type.  All numbers are in
+//    the byte order of the machine which compiled the file; we refuse
+//    files compiled on a machine with a different one.  We don't assume
+//    anything about the alignment of the contents, which may come from
+//    ReadFlagsFromBuffer(), and copy each record out before using it.
+// --------------------------------------------------------------------
+
+// Distinguishes binary from text flagfiles.  No line of a text flagfile
+// that we would look at can start with the first character.
+static const char kBinaryFlagfileMagic[8] = {
+  '\211', 'G', 'F', 'L', 'A', 'G', 'S', '\n'
+};
+// Changes whenever the format or the way we parse values changes.
+static const uint32 kBinaryFlagfileVersion = 1;
+static const uint32 kBinaryFlagfileByteOrder = 0x01020304;
+
+struct BinaryFlagfileHeader {
+  char magic[8];
+  uint32 version;
+  uint32 byte_order;
+  uint32 num_records;
+  uint32 text_size;         // of the text following the records
+};
+
+struct BinaryFlagfileRecord {
+  enum Kind {
+    FLAG = 1,               // text is "name=value", or just "name"
+    FILENAMES = 2,          // text is a line of glob patterns
+  };
+  uint32 kind;
+  uint32 name_hash;         // FlagNameHash() of the name of a FLAG
+  uint32 text_offset;       // into the text, which NUL-terminates it
+  uint32 text_size;
+  uint32 name_size;         // the "name" part of the text of a FLAG
+  uint32 parsed_types;      // bit 1<<FV_xxx for every type value is valid for
+  int64 int_value;          // the value as an int32, int64 or bool
+  uint64 uint_value;        // the value as a uint32 or uint64
+  double double_value;      // the value as a double
+};
+
+COMPILE_ASSERT(sizeof(BinaryFlagfileHeader) == 24, binary_header_is_packed);
+COMPILE_ASSERT(sizeof(BinaryFlagfileRecord) == 48, binary_record_is_packed);
+
+// Returns true if contents are those of a binary flagfile.
+static bool IsBinaryFlagfile(const char* contents, size_t size) {
+  return size >= sizeof(kBinaryFlagfileMagic) &&
+         memcmp(contents, kBinaryFlagfileMagic,
+                sizeof(kBinaryFlagfileMagic)) == 0;
+}
+
+// Gives access to the records of a binary flagfile, once Init() has
+// checked that all of them lie within the contents.  Thread-compatible.
+class BinaryFlagfileReader {
+ public:
+  BinaryFlagfileReader() : records_(NULL), text_(NULL), num_records_(0) { }
+
+  // Returns false and sets error if contents are not a binary flagfile
+  // that we can read.
+  bool Init(const char* contents, size_t size, string* error);
+
+  size_t num_records() const { return num_records_; }
+  void GetRecord(size_t i, BinaryFlagfileRecord* record) const {
+    memcpy(record, records_ + i * sizeof(*record), sizeof(*record));
+  }
+  // The NUL-terminated text of record.
+  const char* Text(const BinaryFlagfileRecord& record) const {
+    return text_ + record.text_offset;
+  }
+
+ private:
+  const char* records_;
+  const char* text_;
+  size_t num_records_;
+};
+
+bool BinaryFlagfileReader::Init(const char* contents, size_t size,
+                                string* error) {
+  BinaryFlagfileHeader header;
+  if (size < sizeof(header) || !IsBinaryFlagfile(contents, size)) {
+    *error = StringPrintf("%snot a binary flagfile\n", kError);
+    return false;
+  }
+  memcpy(&header, contents, sizeof(header));
+  if (header.byte_order != kBinaryFlagfileByteOrder ||
+      header.version != kBinaryFlagfileVersion) {
+    *error = StringPrintf("%sbinary flagfile was compiled for another "
+                          "machine or version of gflags\n", kError);
+    return false;
+  }
+  const size_t records_size =
+      static_cast<size_t>(header.num_records) * sizeof(BinaryFlagfileRecord);
+  if (records_size / sizeof(BinaryFlagfileRecord) != header.num_records ||
+      size - sizeof(header) < records_size ||
+      size - sizeof(header) - records_size != header.text_size) {
+    *error = StringPrintf("%sbinary flagfile is truncated\n", kError);
+    return false;
+  }
+  records_ = contents + sizeof(header);
+  text_ = records_ + records_size;
+  num_records_ = header.num_records;
+  for (size_t i = 0; i < num_records_; ++i) {
+    BinaryFlagfileRecord record;
+    GetRecord(i, &record);
+    if ((record.kind != BinaryFlagfileRecord::FLAG &&
+         record.kind != BinaryFlagfileRecord::FILENAMES) ||
+        record.text_offset >= header.text_size ||
+        record.text_size >= header.text_size - record.text_offset ||
+        text_[record.text_offset + record.text_size] != '\0' ||
+        memchr(text_ + record.text_offset, '\0', record.text_size) != NULL ||
+        record.name_size > record.text_size) {
+      *error = StringPrintf("%sbinary flagfile is corrupt\n", kError);
+      return false;
+    }
+  }
+  return true;
+}
+
+string CommandLineFlagParser::ProcessOptionsFromBufferLocked(
+    const char* contents, size_t size, FlagSettingMode set_mode) {
+  if (IsBinaryFlagfile(contents, size))
+    return ProcessBinaryOptionsLocked(contents, size, set_mode);
+
+  string retval;
+  // Each line is a view into contents.  The only copies we make are of
+  // the values we set, which must be NUL-terminated, and of glob
+  // patterns for fnmatch().  Both reuse their buffer from line to line.
+  string value_buffer, glob_buffer;
+  FlagfileLines lines(contents,
+                      FindCharOrEnd(contents, contents + size, '\0'));
+  bool flags_are_relevant = true;   // set to false when filenames don't match
+  bool in_filename_section = false;
+
+  // We read this file a line at a time.
+  const char* line;
+  const char* line_end;
+  while (lines.Next(&line, &line_end)) {
+    // Each line can be one of four things:
+    // 1) A comment line -- we skip it
+    // 2) An empty line -- we skip it
+    // 3) A list of filenames -- starts a new filenames+flags section
+    // 4) A --flag=value line -- apply if previous filenames match
+    if (line == line_end || line[0] == '#') {
+      // comment or empty line; just ignore
+
+    } else if (line[0] == '-') {    // flag
+      in_filename_section = false;  // instead, it was a flag-line
+      if (!flags_are_relevant)      // skip this flag; applies to someone else
+        continue;
+
+      const char* name_and_val = line + 1;            // skip the leading -
+      if (name_and_val != line_end && *name_and_val == '-')
+        name_and_val++;                               // skip second - too
+      retval += ProcessFlagLineLocked(name_and_val, line_end - name_and_val,
+                                      set_mode, &value_buffer);
+
+    } else {                        // a filename!
+      if (!in_filename_section) {   // start over: assume filenames don't match
+        in_filename_section = true;
+        flags_are_relevant = false;
       }
+      // We can stop looking as soon as one line matches.
+      if (!flags_are_relevant)
+        flags_are_relevant = FilenamesMatchProgram(line, line_end,
+                                                   &glob_buffer);
     }
   }
   return retval;
 }
 
+string CommandLineFlagParser::ProcessFlagLineLocked(const char* name_and_val,
+                                                    size_t size,
+                                                    FlagSettingMode set_mode,
+                                                    string* value_buffer) {
+  const char* key;
+  size_t key_len;
+  const char* value;
+  size_t value_len;
+  string error_message;
+  CommandLineFlag* flag = registry_->SplitArgumentLocked(
+      name_and_val, size, &key, &key_len, &value, &value_len, &error_message);
+  // By API, errors parsing flagfile lines are silently ignored.
+  if (flag == NULL) {
+    // "WARNING: flagname '" + key + "' not found\n"
+  } else if (value == NULL) {
+    // "WARNING: flagname '" + key + "' missing a value\n"
+  } else {
+    value_buffer->assign(value, value_len);
+    return ProcessSingleOptionLocked(flag, value_buffer->c_str(), set_mode);
+  }
+  return "";
+}
+
+void CommandLineFlagParser::ApplyDeferredAssignmentsLocked() {
+  for (size_t i = 0; i < deferred_assignments_.size(); ++i) {
+    CommandLineFlag* const flag = deferred_assignments_[i].first;
+    string error;
+    if (!registry_->SetFlagLocked(flag, deferred_assignments_[i].second.c_str(),
+                                  SET_FLAGS_VALUE, NULL, &error))
+      error_flags_[flag->name()] = error;
+  }
+  deferred_assignments_.clear();
+  deferred_index_.clear();
+}
+
+string CommandLineFlagParser::ProcessParsedOptionLocked(
+    CommandLineFlag* flag, const FlagValue& value, FlagSettingMode set_mode) {
+  string msg, error;
+  if (!registry_->SetFlagLocked(flag, value, set_mode,
+                                describe_new_values_ ? &msg : NULL, &error)) {
+    error_flags_[flag->name()] = error;
+    return "";
+  }
+  return msg;
+}
+
+string CommandLineFlagParser::ProcessBinaryOptionsLocked(
+    const char* contents, size_t size, FlagSettingMode set_mode) {
+  BinaryFlagfileReader reader;
+  string error;
+  if (!reader.Init(contents, size, &error)) {
+    error_flags_["flagfile"] = error;
+    return "";
+  }
+
+  string retval, value_buffer, glob_buffer;
+  bool flags_are_relevant = true;   // set to false when filenames don't match
+  bool in_filename_section = false;
+  for (size_t i = 0; i < reader.num_records(); ++i) {
+    BinaryFlagfileRecord record;
+    reader.GetRecord(i, &record);
+    const char* const text = reader.Text(record);
+
+    if (record.kind == BinaryFlagfileRecord::FILENAMES) {
+      if (!in_filename_section) {
+        in_filename_section = true;
+        flags_are_relevant = false;
+      }
+      if (!flags_are_relevant)
+        flags_are_relevant = FilenamesMatchProgram(
+            text, text + record.text_size, &glob_buffer);
+      continue;
+    }
+    in_filename_section = false;
+    if (!flags_are_relevant)
+      continue;
+
+    // Anything but a known flag with a value, and a value of its type,
+    // takes the same path as a text line, which deals with --noflag,
+    // --flag-name, missing values, and the errors.
+    CommandLineFlag* flag = NULL;
+    if (record.name_size < record.text_size)
+      flag = registry_->FindFlagLocked(text, record.name_size,
+                                       record.name_hash);
+    if (flag == NULL ||
+        (flag->Type() != FlagValue::FV_STRING &&
+         (record.parsed_types & (1u << flag->Type())) == 0)) {
+      retval += ProcessFlagLineLocked(text, record.text_size, set_mode,
+                                      &value_buffer);
+      continue;
+    }
+    const char* const value = text + record.name_size + 1;
+    if (flag->Type() == FlagValue::FV_STRING || deduplicate_assignments_) {
+      // The value is NUL-terminated already, and --flagfile and
+      // friends are string flags.  When deduplicating, only the last
+      // value counts, so there is no point in using the parsed ones.
+      retval += ProcessSingleOptionLocked(flag, value, set_mode);
+      continue;
+    }
+
+    // The values live on the stack, so setting a flag to one of them
+    // neither parses nor allocates anything.
+    switch (flag->Type()) {
+      case FlagValue::FV_BOOL: {
+        bool value = (record.int_value != 0);
+        const FlagValue parsed_value(&value, false);
+        retval += ProcessParsedOptionLocked(flag, parsed_value, set_mode);
+        break;
+      }
+      case FlagValue::FV_INT32: {
+        int32 value = static_cast<int32>(record.int_value);
+        const FlagValue parsed_value(&value, false);
+        retval += ProcessParsedOptionLocked(flag, parsed_value, set_mode);
+        break;
+      }
+      case FlagValue::FV_UINT32: {
+        uint32 value = static_cast<uint32>(record.uint_value);
+        const FlagValue parsed_value(&value, false);
+        retval += ProcessParsedOptionLocked(flag, parsed_value, set_mode);
+        break;
+      }
+      case FlagValue::FV_INT64: {
+        int64 value = record.int_value;
+        const FlagValue parsed_value(&value, false);
+        retval += ProcessParsedOptionLocked(flag, parsed_value, set_mode);
+        break;
+      }
+      case FlagValue::FV_UINT64: {
+        uint64 value = record.uint_value;
+        const FlagValue parsed_value(&value, false);
+        retval += ProcessParsedOptionLocked(flag, parsed_value, set_mode);
+        break;
+      }
+      case FlagValue::FV_DOUBLE: {
+        double value = record.double_value;
+        const FlagValue parsed_value(&value, false);
+        retval += ProcessParsedOptionLocked(flag, parsed_value, set_mode);
+        break;
+      }
+      default:
+        assert(false);   // strings were dealt with above
+    }
+  }
+  return retval;
+}
+
+// Appends the values of the --flagfile lines in contents to flagvals.
+static void FindFlagfileLines(const char* contents, size_t size,
+                              vector<string>* flagvals) {
+  if (IsBinaryFlagfile(contents, size)) {
+    BinaryFlagfileReader reader;
+    string error;
+    if (!reader.Init(contents, size, &error)) return;
+    for (size_t i = 0; i < reader.num_records(); ++i) {
+      BinaryFlagfileRecord record;
+      reader.GetRecord(i, &record);
+      const char* const text = reader.Text(record);
+      if (record.kind == BinaryFlagfileRecord::FLAG &&
+          record.name_size < record.text_size &&
+          EqualsView("flagfile", text, record.name_size)) {
+        flagvals->push_back(text + record.name_size + 1);
+      }
+    }
+    return;
+  }
+  const char* const contents_end = FindCharOrEnd(contents, contents + size,
+                                                 '\0');
+  for (const char* line = contents; line != contents_end; ) {
+    const char* line_end = FindCharOrEnd(line, contents_end, '\n');
+    const char* next_line = (line_end == contents_end) ? line_end
+                                                       : line_end + 1;
+    line_end = FindCharOrEnd(line, line_end, '\r');
+    while (line != line_end && isspace(*line))
+      ++line;
+    if (line != line_end && *line == '-') {
+      ++line;
+      if (line != line_end && *line == '-')
+        ++line;
+      static const char kFlagfile[] = "flagfile=";
+      const size_t kFlagfileLen = sizeof(kFlagfile) - 1;
+      if (static_cast<size_t>(line_end - line) > kFlagfileLen &&
+          memcmp(line, kFlagfile, kFlagfileLen) == 0) {
+        flagvals->push_back(string(line + kFlagfileLen, line_end));
+      }
+    }
+    line = next_line;
+  }
+}
+
+// What PrefetchFlagfile() works on.
+struct FlagfilePrefetch {
+  vector<string> filenames;
+  vector<FlagfileContents*> contents;
+  vector<vector<string> > nested_flagvals;
+};
+
+// The task run by PrefetchFlagfiles(): reads one of the files.
+static void PrefetchFlagfile(void* arg, size_t i) {
+  FlagfilePrefetch* const prefetch = static_cast<FlagfilePrefetch*>(arg);
+  FlagfileContents* const contents = new FlagfileContents;
+  if (!contents->Load(prefetch->filenames[i].c_str(), true)) {
+    delete contents;
+    return;
+  }
+  prefetch->contents[i] = contents;
+  // Looking for nested flagfiles also pulls all the pages into memory.
+  FindFlagfileLines(contents->data(), contents->size(),
+                    &prefetch->nested_flagvals[i]);
+}
+
+void CommandLineFlagParser::PrefetchFlagfiles(const vector<string>& flagvals) {
+  // The number of files we read at once.
+  static const size_t kMaxThreads = 8;
+
+  vector<string> pending_flagvals(flagvals);
+  FlagfilePrefetch prefetch;
+  while (!pending_flagvals.empty()) {
+    // Read all the files named in pending_flagvals that we haven't
+    // read yet, then go on with the files that they name in turn.
+    // Unlike ParseFlagList(), we quietly skip bad entries: they may be
+    // on lines that never get applied.
+    prefetch.filenames.clear();
+    for (size_t i = 0; i < pending_flagvals.size(); ++i) {
+      const string& flagval = pending_flagvals[i];
+      for (size_t start = 0; start < flagval.size(); ) {
+        size_t end = flagval.find(',', start);
+        if (end == string::npos) end = flagval.size();
+        const string filename(flagval, start, end - start);
+        start = end + 1;
+        if (filename.empty() || filename[0] == '-') continue;
+        const pair<string, FlagfileContents*> entry(filename, NULL);
+        if (prefetched_flagfiles_.insert(entry).second)
+          prefetch.filenames.push_back(filename);
+      }
+    }
+    prefetch.contents.assign(prefetch.filenames.size(), NULL);
+    prefetch.nested_flagvals.assign(prefetch.filenames.size(),
+                                    vector<string>());
+    RunInParallel(prefetch.filenames.size(), kMaxThreads,
+                  &PrefetchFlagfile, &prefetch);
+
+    pending_flagvals.clear();
+    for (size_t i = 0; i < prefetch.filenames.size(); ++i) {
+      prefetched_flagfiles_[prefetch.filenames[i]] = prefetch.contents[i];
+      pending_flagvals.insert(pending_flagvals.end(),
+                              prefetch.nested_flagvals[i].begin(),
+                              prefetch.nested_flagvals[i].end());
+    }
+  }
+}
+
 // --------------------------------------------------------------------
 // GetFromEnv()
 // AddFlagValidator()
@@ -1398,7 +2874,7 @@ bool AddFlagValidator(const void* flag_ptr, ValidateFnProto validate_fn_proto) {
                  << flag->name() << "': validate-fn already registered";
     return false;
   } else {
-    flag->validate_fn_proto_ = validate_fn_proto;
+    registry->SetValidateFunctionLocked(flag, validate_fn_proto);
     return true;
   }
 }
@@ -1419,30 +2895,26 @@ bool AddFlagValidator(const void* flag_ptr, ValidateFnProto validate_fn_proto) {
 //    values in a global destructor.
 // --------------------------------------------------------------------
 
-namespace {
-void RegisterCommandLineFlag(const char* name,
-                             const char* help,
-                             const char* filename,
-                             FlagValue* current,
-                             FlagValue* defvalue) {
-  if (help == NULL)
-    help = "";
-  // Importantly, flag_ will never be deleted, so storage is always good.
-  CommandLineFlag* flag =
-      new CommandLineFlag(name, help, filename, current, defvalue);
-  FlagRegistry::GlobalRegistry()->RegisterFlag(flag);  // default registry
-}
-}
-
 template <typename FlagType>
 FlagRegisterer::FlagRegisterer(const char* name,
                                const char* help,
                                const char* filename,
                                FlagType* current_storage,
                                FlagType* defvalue_storage) {
-  FlagValue* const current = new FlagValue(current_storage, false);
-  FlagValue* const defvalue = new FlagValue(defvalue_storage, false);
-  RegisterCommandLineFlag(name, help, filename, current, defvalue);
+  if (help == NULL)
+    help = "";
+  FlagRegistry* const registry = FlagRegistry::GlobalRegistry();
+  FlagRegistryLock frl(registry);
+  // Importantly, the flag will never be deleted (only its registry's
+  // memory is freed, at shutdown), so storage is always good.
+  FlagValue* const current = new (registry->AllocateLocked(sizeof(FlagValue)))
+      FlagValue(current_storage, false);
+  FlagValue* const defvalue = new (registry->AllocateLocked(sizeof(FlagValue)))
+      FlagValue(defvalue_storage, false);
+  CommandLineFlag* const flag =
+      new (registry->AllocateLocked(sizeof(CommandLineFlag)))
+      CommandLineFlag(name, help, filename, current, defvalue);
+  registry->RegisterFlagLocked(flag);
 }
 
 // Force compiler to generate code for the given template specialization.
@@ -1463,35 +2935,103 @@ INSTANTIATE_FLAG_REGISTERER_CTOR(std::string);
 #undef INSTANTIATE_FLAG_REGISTERER_CTOR
 
 // --------------------------------------------------------------------
+// VisitAllFlags()
 // GetAllFlags()
-//    The main way the FlagRegistry class exposes its data.  This
-//    returns, as strings, all the info about all the flags in
-//    the main registry, sorted first by filename they are defined
-//    in, and then by flagname.
+//    The main ways the FlagRegistry class exposes its data.  These
+//    pass or return all the info about all the flags in the main
+//    registry, sorted first by filename they are defined in, and then
+//    by flagname.  GetAllFlags() copies it all into strings, while
+//    VisitAllFlags() lets the caller look at just what it needs.
 // --------------------------------------------------------------------
 
-struct FilenameFlagnameCmp {
-  bool operator()(const CommandLineFlagInfo& a,
-                  const CommandLineFlagInfo& b) const {
-    int cmp = strcmp(a.filename.c_str(), b.filename.c_str());
-    if (cmp == 0)
-      cmp = strcmp(a.name.c_str(), b.name.c_str());  // secondary sort key
-    return cmp < 0;
+static inline const CommandLineFlag* ViewedFlag(const void* flag) {
+  return static_cast<const CommandLineFlag*>(flag);
+}
+
+const char* CommandLineFlagView::name() const {
+  return ViewedFlag(flag_)->name();
+}
+
+const char* CommandLineFlagView::type() const {
+  return ViewedFlag(flag_)->type_name();
+}
+
+const char* CommandLineFlagView::description() const {
+  return ViewedFlag(flag_)->help();
+}
+
+const char* CommandLineFlagView::filename() const {
+  return ViewedFlag(flag_)->CleanFileName();
+}
+
+bool CommandLineFlagView::has_validator_fn() const {
+  return ViewedFlag(flag_)->validate_function() != NULL;
+}
+
+bool CommandLineFlagView::is_default() const {
+  return ViewedFlag(flag_)->IsDefault();
+}
+
+const void* CommandLineFlagView::flag_ptr() const {
+  return ViewedFlag(flag_)->flag_ptr();
+}
+
+void CommandLineFlagView::AppendCurrentValue(string* output) const {
+  ViewedFlag(flag_)->AppendCurrentValue(output);
+}
+
+void CommandLineFlagView::AppendDefaultValue(string* output) const {
+  ViewedFlag(flag_)->AppendDefaultValue(output);
+}
+
+void CommandLineFlagView::FillCommandLineFlagInfo(
+    CommandLineFlagInfo* result) const {
+  ViewedFlag(flag_)->FillCommandLineFlagInfo(result);
+}
+
+CommandLineFlagVisitor::~CommandLineFlagVisitor() {
+}
+
+void VisitAllFlags(CommandLineFlagVisitor* visitor) {
+  FlagRegistry* const registry = FlagRegistry::GlobalRegistry();
+  vector<CommandLineFlag*> newly_modified;
+  {
+    FlagRegistryReaderLock frl(registry);
+    vector<CommandLineFlag*> sorted_flags;
+    registry->GetFlagsSortedByFileLocked(&sorted_flags);
+    for (vector<CommandLineFlag*>::const_iterator i = sorted_flags.begin();
+         i != sorted_flags.end(); ++i) {
+      const CommandLineFlagView view(*i);
+      visitor->Visit(view);
+      if (!(*i)->Modified() && !(*i)->IsDefault())
+        newly_modified.push_back(*i);
+    }
+  }
+  if (!newly_modified.empty()) {
+    // Some flags were assigned through FLAGS_name; remember that.
+    FlagRegistryLock frl(registry);
+    for (size_t i = 0; i < newly_modified.size(); ++i)
+      newly_modified[i]->UpdateModifiedBit();
+  }
+}
+
+// Appends a CommandLineFlagInfo of each flag it visits to a vector.
+class FlagInfoCollector : public CommandLineFlagVisitor {
+ public:
+  explicit FlagInfoCollector(vector<CommandLineFlagInfo>* infos)
+      : infos_(infos) { }
+  virtual void Visit(const CommandLineFlagView& flag) {
+    infos_->push_back(CommandLineFlagInfo());
+    flag.FillCommandLineFlagInfo(&infos_->back());
   }
+
+ private:
+  vector<CommandLineFlagInfo>* const infos_;
 };
 
 void GetAllFlags(vector<CommandLineFlagInfo>* OUTPUT) {
-  FlagRegistry* const registry = FlagRegistry::GlobalRegistry();
-  registry->Lock();
-  for (FlagRegistry::FlagConstIterator i = registry->flags_.begin();
-       i != registry->flags_.end(); ++i) {
-    CommandLineFlagInfo fi;
-    i->second->FillCommandLineFlagInfo(&fi);
-    OUTPUT->push_back(fi);
-  }
-  registry->Unlock();
-  // Now sort the flags, first by filename they occur in, then alphabetically
-  sort(OUTPUT->begin(), OUTPUT->end(), FilenameFlagnameCmp());
+  FlagInfoCollector collector(OUTPUT);
+  VisitAllFlags(&collector);
 }
 
 // --------------------------------------------------------------------
@@ -1511,6 +3051,7 @@ void GetAllFlags(vector<CommandLineFlagInfo>* OUTPUT) {
 // These values are not protected by a Mutex because they are normally
 // set only once during program startup.
 static string argv0("UNKNOWN");  // just the program name
+static size_t argv0_basename = 0;  // where basename(argv0) starts
 static string cmdline;           // the entire command-line
 static string program_usage;
 static vector<string> argvs;
@@ -1523,6 +3064,11 @@ void SetArgv(int argc, const char** argv) {
 
   assert(argc > 0); // every program has at least a name
   argv0 = argv[0];
+  size_t pos = argv0.rfind('/');
+#ifdef OS_WINDOWS
+  if (pos == string::npos) pos = argv0.rfind('\\');
+#endif
+  argv0_basename = (pos == string::npos ? 0 : pos + 1);
 
   cmdline.clear();
   for (int i = 0; i < argc; i++) {
@@ -1546,11 +3092,7 @@ const char* ProgramInvocationName() {             // like the GNU libc fn
   return GetArgv0();
 }
 const char* ProgramInvocationShortName() {        // like the GNU libc fn
-  size_t pos = argv0.rfind('/');
-#ifdef OS_WINDOWS
-  if (pos == string::npos) pos = argv0.rfind('\\');
-#endif
-  return (pos == string::npos ? argv0.c_str() : (argv0.c_str() + pos + 1));
+  return argv0.c_str() + argv0_basename;
 }
 
 void SetUsageMessage(const string& usage) {
@@ -1582,10 +3124,12 @@ const char* VersionString() {
 
 // --------------------------------------------------------------------
 // GetCommandLineOption()
+// AppendCommandLineOption()
 // GetCommandLineFlagInfo()
 // GetCommandLineFlagInfoOrDie()
 // SetCommandLineOption()
 // SetCommandLineOptionWithMode()
+// SetCommandLineOptions()
 //    The programmatic way to set a flag's value, using a string
 //    for its name rather than the variable itself (that is,
 //    SetCommandLineOption("foo", x) rather than FLAGS_foo = x).
@@ -1595,7 +3139,7 @@ const char* VersionString() {
 //    All of these work on the default, global registry.
 //       For GetCommandLineOption, return false if no such flag
 //    is known, true otherwise.  We clear "value" if a suitable
-//    flag is found.
+//    flag is found.  AppendCommandLineOption appends to it instead.
 // --------------------------------------------------------------------
 
 
@@ -1605,28 +3149,49 @@ bool GetCommandLineOption(const char* name, string* value) {
   assert(value);
 
   FlagRegistry* const registry = FlagRegistry::GlobalRegistry();
-  FlagRegistryLock frl(registry);
+  FlagRegistryReaderLock frl(registry);
   CommandLineFlag* flag = registry->FindFlagLocked(name);
   if (flag == NULL) {
     return false;
   } else {
-    *value = flag->current_value();
+    value->clear();
+    flag->AppendCurrentValue(value);
     return true;
   }
 }
 
-bool GetCommandLineFlagInfo(const char* name, CommandLineFlagInfo* OUTPUT) {
-  if (NULL == name) return false;
+bool AppendCommandLineOption(const char* name, string* output) {
+  if (NULL == name)
+    return false;
+  assert(output);
+
   FlagRegistry* const registry = FlagRegistry::GlobalRegistry();
-  FlagRegistryLock frl(registry);
+  FlagRegistryReaderLock frl(registry);
   CommandLineFlag* flag = registry->FindFlagLocked(name);
-  if (flag == NULL) {
+  if (flag == NULL)
     return false;
-  } else {
+  flag->AppendCurrentValue(output);
+  return true;
+}
+
+bool GetCommandLineFlagInfo(const char* name, CommandLineFlagInfo* OUTPUT) {
+  if (NULL == name) return false;
+  FlagRegistry* const registry = FlagRegistry::GlobalRegistry();
+  CommandLineFlag* flag;
+  {
+    FlagRegistryReaderLock frl(registry);
+    flag = registry->FindFlagLocked(name);
+    if (flag == NULL)
+      return false;
     assert(OUTPUT);
     flag->FillCommandLineFlagInfo(OUTPUT);
-    return true;
+    if (OUTPUT->is_default || flag->Modified())
+      return true;
   }
+  // The flag was assigned through FLAGS_name; remember that.
+  FlagRegistryLock frl(registry);
+  flag->UpdateModifiedBit();
+  return true;
 }
 
 CommandLineFlagInfo GetCommandLineFlagInfoOrDie(const char* name) {
@@ -1642,10 +3207,13 @@ string SetCommandLineOptionWithMode(const char* name, const char* value,
                                     FlagSettingMode set_mode) {
   string result;
   FlagRegistry* const registry = FlagRegistry::GlobalRegistry();
+  CommandLineFlagParser parser(registry);
+  if (prefetch_flagfiles && value != NULL && strcmp(name, "flagfile") == 0)
+    parser.PrefetchFlagfiles(vector<string>(1, value));
   FlagRegistryLock frl(registry);
   CommandLineFlag* flag = registry->FindFlagLocked(name);
   if (flag) {
-    CommandLineFlagParser parser(registry);
+    parser.DescribeNewValues();
     result = parser.ProcessSingleOptionLocked(flag, value, set_mode);
     if (!result.empty()) {   // in the error case, we've already logged
       // Could consider logging this change
@@ -1659,6 +3227,109 @@ string SetCommandLineOption(const char* name, const char* value) {
   return SetCommandLineOptionWithMode(name, value, SET_FLAGS_VALUE);
 }
 
+bool SetCommandLineOptions(vector<CommandLineOptionUpdate>* updates) {
+  FlagRegistry* const registry = FlagRegistry::GlobalRegistry();
+  CommandLineFlagParser parser(registry);
+  FlagRegistryLock frl(registry);
+  return parser.SetOptionsLocked(updates);
+}
+
+// --------------------------------------------------------------------
+// FlagHandle
+//    Keeps the CommandLineFlag it found, which lives in the registry's
+//    arena for as long as the program runs, so that it can get and
+//    set the flag without looking it up again.
+// --------------------------------------------------------------------
+
+FlagHandle::FlagHandle(const char* name) : flag_(NULL) {
+  if (name != NULL) {
+    FlagRegistry* const registry = FlagRegistry::GlobalRegistry();
+    FlagRegistryReaderLock frl(registry);
+    flag_ = registry->FindFlagLocked(name);
+  }
+}
+
+FlagHandle::FlagHandle(const void* flag_ptr) : flag_(NULL) {
+  FlagRegistry* const registry = FlagRegistry::GlobalRegistry();
+  FlagRegistryReaderLock frl(registry);
+  flag_ = registry->FindFlagViaPtrLocked(flag_ptr);
+}
+
+bool FlagHandle::valid() const {
+  return flag_ != NULL;
+}
+
+const char* FlagHandle::name() const {
+  return flag_ == NULL ? NULL : static_cast<CommandLineFlag*>(flag_)->name();
+}
+
+template <typename T>
+bool FlagHandle::Get(T* value) const {
+  const CommandLineFlag* const flag = static_cast<CommandLineFlag*>(flag_);
+  if (flag == NULL ||
+      flag->Type() != FlagValue::FlagValueTraits<T>::kValueType)
+    return false;
+  FlagRegistryReaderLock frl(FlagRegistry::GlobalRegistry());
+  FlagValue(value, false).CopyFrom(*flag->current_);
+  return true;
+}
+
+template <typename T>
+bool FlagHandle::Set(const T& value, FlagSettingMode set_mode) {
+  CommandLineFlag* const flag = static_cast<CommandLineFlag*>(flag_);
+  if (flag == NULL ||
+      flag->Type() != FlagValue::FlagValueTraits<T>::kValueType ||
+      IsRecursiveFlag(flag))
+    return false;
+  // SetFlagLocked() only reads new_value, so it's fine to cast away the
+  // const rather than copy value (which may be a long string).
+  const FlagValue new_value(const_cast<T*>(&value), false);
+  FlagRegistry* const registry = FlagRegistry::GlobalRegistry();
+  FlagRegistryLock frl(registry);
+  return registry->SetFlagLocked(flag, new_value, set_mode, NULL, NULL);
+}
+
+// Instantiate Get() and Set() for all supported flag types.
+#define INSTANTIATE_FLAG_HANDLE_ACCESSORS(type)                        \
+  template bool FlagHandle::Get(type* value) const;                    \
+  template bool FlagHandle::Set(const type& value, FlagSettingMode)
+
+INSTANTIATE_FLAG_HANDLE_ACCESSORS(bool);
+INSTANTIATE_FLAG_HANDLE_ACCESSORS(int32);
+INSTANTIATE_FLAG_HANDLE_ACCESSORS(uint32);
+INSTANTIATE_FLAG_HANDLE_ACCESSORS(int64);
+INSTANTIATE_FLAG_HANDLE_ACCESSORS(uint64);
+INSTANTIATE_FLAG_HANDLE_ACCESSORS(double);
+INSTANTIATE_FLAG_HANDLE_ACCESSORS(string);
+
+#undef INSTANTIATE_FLAG_HANDLE_ACCESSORS
+
+bool FlagHandle::GetAsString(string* value) const {
+  const CommandLineFlag* const flag = static_cast<CommandLineFlag*>(flag_);
+  if (flag == NULL)
+    return false;
+  assert(value);
+  FlagRegistryReaderLock frl(FlagRegistry::GlobalRegistry());
+  value->clear();
+  flag->AppendCurrentValue(value);
+  return true;
+}
+
+string FlagHandle::SetFromString(const char* value, FlagSettingMode set_mode) {
+  CommandLineFlag* const flag = static_cast<CommandLineFlag*>(flag_);
+  if (flag == NULL)
+    return "";
+  FlagRegistry* const registry = FlagRegistry::GlobalRegistry();
+  CommandLineFlagParser parser(registry);
+  if (prefetch_flagfiles && value != NULL &&
+      strcmp(flag->name(), "flagfile") == 0)
+    parser.PrefetchFlagfiles(vector<string>(1, value));
+  FlagRegistryLock frl(registry);
+  parser.DescribeNewValues();
+  // As for SetCommandLineOptionWithMode(), this is empty on error.
+  return parser.ProcessSingleOptionLocked(flag, value, set_mode);
+}
+
 // --------------------------------------------------------------------
 // FlagSaver
 // FlagSaverImpl
@@ -1667,6 +3338,9 @@ string SetCommandLineOption(const char* name, const char* value) {
 //    Its major implementation challenge is that it never modifies
 //    pointers in the 'main' registry, so global FLAG_* vars always
 //    point to the right place.
+//       A FlagSaverImpl can also serve as the undo log of a registry
+//    (see FlagRegistry::SetUndoLogLocked()), in which case it stores
+//    only the flags which the registry changes, as it changes them.
 // --------------------------------------------------------------------
 
 class FlagSaverImpl {
@@ -1674,56 +3348,144 @@ class FlagSaverImpl {
   // Constructs an empty FlagSaverImpl object.
   explicit FlagSaverImpl(FlagRegistry* main_registry)
       : main_registry_(main_registry) { }
-  ~FlagSaverImpl() {
-    // reclaim memory from each of our CommandLineFlags
-    vector<CommandLineFlag*>::const_iterator it;
-    for (it = backup_registry_.begin(); it != backup_registry_.end(); ++it)
-      delete *it;
-  }
 
   // Saves the flag states from the flag registry into this object.
   // It's an error to call this more than once.
   // Must be called when the registry mutex is not held.
   void SaveFromRegistry() {
-    FlagRegistryLock frl(main_registry_);
-    assert(backup_registry_.empty());   // call only once!
+    FlagRegistryReaderLock frl(main_registry_);
+    assert(saved_flags_.empty());   // call only once!
+    saved_flags_.reserve(main_registry_->flags_.size());
     for (FlagRegistry::FlagConstIterator it = main_registry_->flags_.begin();
          it != main_registry_->flags_.end();
          ++it) {
-      const CommandLineFlag* main = it->second;
-      // Sets up all the const variables in backup correctly
-      CommandLineFlag* backup = new CommandLineFlag(
-          main->name(), main->help(), main->filename(),
-          main->current_->New(), main->defvalue_->New());
-      // Sets up all the non-const variables in backup correctly
-      backup->CopyFrom(*main);
-      backup_registry_.push_back(backup);   // add it to a convenient list
+      SaveFlagLocked(*it);
     }
   }
 
+  // Saves the state of flag, unless we have saved it already.  This is
+  // how the registry whose undo log we are saves a flag it will change.
+  void SaveFlagIfNewLocked(CommandLineFlag* flag) {
+    if (undo_logged_.insert(flag).second)
+      SaveFlagLocked(flag);
+  }
+
   // Restores the saved flag states into the flag registry.  We
   // assume no flags were added or deleted from the registry since
   // the SaveFromRegistry; if they were, that's trouble!  Must be
   // called when the registry mutex is not held.
   void RestoreToRegistry() {
     FlagRegistryLock frl(main_registry_);
-    vector<CommandLineFlag*>::const_iterator it;
-    for (it = backup_registry_.begin(); it != backup_registry_.end(); ++it) {
-      CommandLineFlag* main = main_registry_->FindFlagLocked((*it)->name());
-      if (main != NULL) {       // if NULL, flag got deleted from registry(!)
-        main->CopyFrom(**it);
-      }
-    }
+    vector<SavedFlag>::const_iterator it;
+    for (it = saved_flags_.begin(); it != saved_flags_.end(); ++it)
+      RestoreFlagLocked(*it);
   }
 
  private:
+  // A saved flag value.  Values of all types but string are kept right
+  // here, so that saving them allocates no memory; a string is kept in
+  // strings_, at the given index.
+  union SavedValue {
+    bool b;
+    int32 i32;
+    uint32 u32;
+    int64 i64;
+    uint64 u64;
+    double d;
+    size_t string_index;
+  };
+
+  // The non-const members of a flag.
+  struct SavedFlag {
+    CommandLineFlag* flag;
+    ValidateFnProto validate_fn_proto;
+    bool modified;
+    SavedValue current;
+    SavedValue defvalue;
+  };
+
+  void SaveFlagLocked(CommandLineFlag* flag) {
+    SavedFlag saved;
+    saved.flag = flag;
+    saved.validate_fn_proto = flag->validate_fn_proto_;
+    saved.modified = flag->modified_;
+    SaveValue(*flag->current_, &saved.current);
+    SaveValue(*flag->defvalue_, &saved.defvalue);
+    saved_flags_.push_back(saved);
+  }
+
+  // Writes only what has changed, so that we don't write to flags
+  // which others may be reading concurrently without need.
+  void RestoreFlagLocked(const SavedFlag& saved) {
+    CommandLineFlag* const flag = saved.flag;
+    if (flag->modified_ != saved.modified)
+      flag->modified_ = saved.modified;
+    RestoreValue(saved.current, flag->current_);
+    RestoreValue(saved.defvalue, flag->defvalue_);
+    if (flag->validate_fn_proto_ != saved.validate_fn_proto)
+      flag->validate_fn_proto_ = saved.validate_fn_proto;
+  }
+
+  // Copies value into *saved, which is of the same type.
+  template <typename T>
+  static void SaveValueAs(const FlagValue& value, T* saved) {
+    FlagValue(saved, false).CopyFrom(value);
+  }
+
+  // Copies *saved into value, which is of the same type, unless they
+  // are equal already.
+  template <typename T>
+  static void RestoreValueAs(T* saved, FlagValue* value) {
+    const FlagValue saved_value(saved, false);
+    if (!value->Equal(saved_value))
+      value->CopyFrom(saved_value);
+  }
+
+  void SaveValue(const FlagValue& value, SavedValue* saved) {
+    switch (value.Type()) {
+      case FlagValue::FV_BOOL:   SaveValueAs(value, &saved->b);    break;
+      case FlagValue::FV_INT32:  SaveValueAs(value, &saved->i32);  break;
+      case FlagValue::FV_UINT32: SaveValueAs(value, &saved->u32);  break;
+      case FlagValue::FV_INT64:  SaveValueAs(value, &saved->i64);  break;
+      case FlagValue::FV_UINT64: SaveValueAs(value, &saved->u64);  break;
+      case FlagValue::FV_DOUBLE: SaveValueAs(value, &saved->d);    break;
+      case FlagValue::FV_STRING:
+        saved->string_index = strings_.size();
+        strings_.push_back(string());
+        SaveValueAs(value, &strings_.back());
+        break;
+      default: assert(false);  // unknown type
+    }
+  }
+
+  void RestoreValue(SavedValue saved, FlagValue* value) {
+    switch (value->Type()) {
+      case FlagValue::FV_BOOL:   RestoreValueAs(&saved.b, value);    break;
+      case FlagValue::FV_INT32:  RestoreValueAs(&saved.i32, value);  break;
+      case FlagValue::FV_UINT32: RestoreValueAs(&saved.u32, value);  break;
+      case FlagValue::FV_INT64:  RestoreValueAs(&saved.i64, value);  break;
+      case FlagValue::FV_UINT64: RestoreValueAs(&saved.u64, value);  break;
+      case FlagValue::FV_DOUBLE: RestoreValueAs(&saved.d, value);    break;
+      case FlagValue::FV_STRING:
+        RestoreValueAs(&strings_[saved.string_index], value);
+        break;
+      default: assert(false);  // unknown type
+    }
+  }
+
   FlagRegistry* const main_registry_;
-  vector<CommandLineFlag*> backup_registry_;
+  vector<SavedFlag> saved_flags_;
+  vector<string> strings_;             // the saved values of string flags
+  set<const CommandLineFlag*> undo_logged_;  // see SaveFlagIfNewLocked()
 
   FlagSaverImpl(const FlagSaverImpl&);  // no copying!
   void operator=(const FlagSaverImpl&);
 };
 
+void FlagRegistry::SaveToUndoLogLocked(CommandLineFlag* flag) {
+  undo_log_->SaveFlagIfNewLocked(flag);
+}
+
 FlagSaver::FlagSaver()
     : impl_(new FlagSaverImpl(FlagRegistry::GlobalRegistry())) {
   impl_->SaveFromRegistry();
@@ -1781,17 +3543,29 @@ string CommandlineFlagsIntoString() {
 bool ReadFlagsFromString(const string& flagfilecontents,
                          const char* /*prog_name*/,  // TODO(csilvers): nix this
                          bool errors_are_fatal) {
+  return ReadFlagsFromBuffer(flagfilecontents.data(), flagfilecontents.size(),
+                             errors_are_fatal);
+}
+
+// Does the work of ReadFlagsFromBuffer(), using the given parser.
+static bool ReadFlagsWithParser(CommandLineFlagParser* parser,
+                                const char* flagfilecontents, size_t size,
+                                bool errors_are_fatal) {
   FlagRegistry* const registry = FlagRegistry::GlobalRegistry();
+  // Only the flags which the parser sets can need restoring, so rather
+  // than saving all of them up front, we have the registry save each
+  // flag just before it first sets it.
   FlagSaverImpl saved_states(registry);
-  saved_states.SaveFromRegistry();
 
-  CommandLineFlagParser parser(registry);
   registry->Lock();
-  parser.ProcessOptionsFromStringLocked(flagfilecontents, SET_FLAGS_VALUE);
+  registry->SetUndoLogLocked(&saved_states);
+  parser->ProcessOptionsFromBufferLocked(flagfilecontents, size,
+                                         SET_FLAGS_VALUE);
+  registry->SetUndoLogLocked(NULL);
   registry->Unlock();
   // Should we handle --help and such when reading flags from a string?  Sure.
   HandleCommandLineHelpFlags();
-  if (parser.ReportErrors()) {
+  if (parser->ReportErrors()) {
     // Error.  Restore all global flags to their previous values.
     if (errors_are_fatal)
       gflags_exitfunc(1);
@@ -1801,6 +3575,13 @@ bool ReadFlagsFromString(const string& flagfilecontents,
   return true;
 }
 
+bool ReadFlagsFromBuffer(const char* flagfilecontents, size_t size,
+                         bool errors_are_fatal) {
+  CommandLineFlagParser parser(FlagRegistry::GlobalRegistry());
+  return ReadFlagsWithParser(&parser, flagfilecontents, size,
+                             errors_are_fatal);
+}
+
 // TODO(csilvers): nix prog_name in favor of ProgramInvocationShortName()
 bool AppendFlagsIntoFile(const string& filename, const char *prog_name) {
   FILE *fp;
@@ -1827,10 +3608,145 @@ bool AppendFlagsIntoFile(const string& filename, const char *prog_name) {
   return true;
 }
 
-bool ReadFromFlagsFile(const string& filename, const char* prog_name,
+bool ReadFromFlagsFile(const string& filename,
+                       const char* /*prog_name*/,  // TODO(csilvers): nix this
                        bool errors_are_fatal) {
-  return ReadFlagsFromString(ReadFileIntoString(filename.c_str()),
-                             prog_name, errors_are_fatal);
+  CommandLineFlagParser parser(FlagRegistry::GlobalRegistry());
+  if (prefetch_flagfiles) {
+    // This prefetches the files that filename names, too, which is
+    // all we are after: reading filename again below is cheap now.
+    parser.PrefetchFlagfiles(vector<string>(1, filename));
+  }
+  const FlagfileContents contents(filename.c_str());
+  return ReadFlagsWithParser(&parser, contents.data(), contents.size(),
+                             errors_are_fatal);
+}
+
+// --------------------------------------------------------------------
+// CompileFlagfile()
+//    Writes a binary flagfile (see "Binary flagfiles" above) with the
+//    same lines as a text flagfile.  This needs no flags to be
+//    registered: we parse each value as every type of flag, and keep
+//    all the results that are valid, so that the binary flagfile works
+//    for any program that the text one works for.
+// --------------------------------------------------------------------
+
+// Parses value as a FlagType, and on success sets the bit for FlagType
+// in parsed_types and *result to the parsed value.
+template <typename FlagType, typename ResultType>
+static void ParseForBinaryFlagfile(const char* value, uint32* parsed_types,
+                                   ResultType* result) {
+  FlagType parsed;
+  FlagValue flag_value(&parsed, false);
+  if (flag_value.ParseFrom(value)) {
+    *parsed_types |= 1u << flag_value.Type();
+    *result = parsed;
+  }
+}
+
+// Appends a record for the size bytes of text to records, and the text
+// itself to all_text.  Returns false if the binary flagfile would get
+// too big for its 32-bit offsets.
+static bool AddBinaryFlagfileRecord(BinaryFlagfileRecord::Kind kind,
+                                    const char* text, size_t size,
+                                    vector<BinaryFlagfileRecord>* records,
+                                    string* all_text) {
+  if (all_text->size() + size + 1 > 0xffffffffu ||
+      records->size() + 1 > 0xffffffffu / sizeof(BinaryFlagfileRecord))
+    return false;
+  BinaryFlagfileRecord record;
+  memset(&record, 0, sizeof(record));
+  record.kind = kind;
+  record.text_offset = static_cast<uint32>(all_text->size());
+  record.text_size = static_cast<uint32>(size);
+  all_text->append(text, size);
+  all_text->push_back('\0');
+  if (kind == BinaryFlagfileRecord::FLAG) {
+    const char* const equals = static_cast<const char*>(
+        memchr(text, '=', size));
+    record.name_size = static_cast<uint32>(equals ? equals - text : size);
+    record.name_hash = FlagNameHash(text, record.name_size);
+    if (equals != NULL) {
+      // The int32 and int64 (and bool) values, where valid, are the
+      // same, as are the uint32 and uint64 ones.  Parse the narrower
+      // types first so that the wider ones win if they differ at all.
+      const char* const value =
+          all_text->data() + record.text_offset + record.name_size + 1;
+      ParseForBinaryFlagfile<bool>(value, &record.parsed_types,
+                                   &record.int_value);
+      ParseForBinaryFlagfile<int32>(value, &record.parsed_types,
+                                    &record.int_value);
+      ParseForBinaryFlagfile<int64>(value, &record.parsed_types,
+                                    &record.int_value);
+      ParseForBinaryFlagfile<uint32>(value, &record.parsed_types,
+                                     &record.uint_value);
+      ParseForBinaryFlagfile<uint64>(value, &record.parsed_types,
+                                     &record.uint_value);
+      ParseForBinaryFlagfile<double>(value, &record.parsed_types,
+                                     &record.double_value);
+    }
+  }
+  records->push_back(record);
+  return true;
+}
+
+bool CompileFlagfile(const string& filename, const string& binary_filename) {
+  FlagfileContents contents;
+  if (!contents.Load(filename.c_str(), false))
+    return false;
+  if (IsBinaryFlagfile(contents.data(), contents.size())) {
+    errno = EINVAL;    // already compiled
+    return false;
+  }
+
+  // Keep the lines that ProcessOptionsFromBufferLocked() would look at.
+  vector<BinaryFlagfileRecord> records;
+  string text;
+  FlagfileLines lines(contents.data(),
+                      FindCharOrEnd(contents.data(),
+                                    contents.data() + contents.size(), '\0'));
+  const char* line;
+  const char* line_end;
+  while (lines.Next(&line, &line_end)) {
+    bool fits;
+    if (line == line_end || line[0] == '#') {
+      continue;
+    } else if (line[0] == '-') {
+      const char* name_and_val = line + 1;
+      if (name_and_val != line_end && *name_and_val == '-')
+        name_and_val++;
+      fits = AddBinaryFlagfileRecord(BinaryFlagfileRecord::FLAG,
+                                     name_and_val, line_end - name_and_val,
+                                     &records, &text);
+    } else {
+      fits = AddBinaryFlagfileRecord(BinaryFlagfileRecord::FILENAMES,
+                                     line, line_end - line, &records, &text);
+    }
+    if (!fits) {
+      errno = EFBIG;
+      return false;
+    }
+  }
+
+  BinaryFlagfileHeader header;
+  memcpy(header.magic, kBinaryFlagfileMagic, sizeof(header.magic));
+  header.version = kBinaryFlagfileVersion;
+  header.byte_order = kBinaryFlagfileByteOrder;
+  header.num_records = static_cast<uint32>(records.size());
+  header.text_size = static_cast<uint32>(text.size());
+
+  FILE* fp;
+  if ((errno = SafeFOpen(&fp, binary_filename.c_str(), "wb")) != 0)
+    return false;
+  bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+  if (ok && !records.empty())
+    ok = fwrite(&records[0], sizeof(records[0]), records.size(), fp) ==
+         records.size();
+  if (ok && !text.empty())
+    ok = fwrite(text.data(), 1, text.size(), fp) == text.size();
+  if (fclose(fp) != 0)
+    ok = false;
+  return ok;
 }
 
 
@@ -1939,6 +3855,29 @@ static uint32 ParseCommandLineFlagsInternal(int* argc, char*** argv,
 
   FlagRegistry* const registry = FlagRegistry::GlobalRegistry();
   CommandLineFlagParser parser(registry);
+  if (deduplicate_flag_assignments)
+    parser.DeduplicateAssignments();
+
+  if (prefetch_flagfiles) {
+    // Read all the flagfiles that we (might) need now, several at a
+    // time, rather than one after another while holding the lock.
+    vector<string> flagvals;
+    if (!FLAGS_flagfile.empty())
+      flagvals.push_back(FLAGS_flagfile);
+    for (int i = 1; i < *argc; ++i) {
+      const char* arg = (*argv)[i];
+      if (arg[0] != '-' || arg[1] == '\0')    // not a flag
+        continue;
+      arg += (arg[1] == '-') ? 2 : 1;
+      if (*arg == '\0')                       // "--" ends the flags
+        break;
+      if (strncmp(arg, "flagfile=", 9) == 0)
+        flagvals.push_back(arg + 9);
+      else if (strcmp(arg, "flagfile") == 0 && i + 1 < *argc)
+        flagvals.push_back((*argv)[++i]);
+    }
+    parser.PrefetchFlagfiles(flagvals);
+  }
 
   // When we parse the commandline flags, we'll handle --flagfile,
   // --tryfromenv, etc. as we see them (since flag-evaluation order
@@ -1959,6 +3898,8 @@ static uint32 ParseCommandLineFlagsInternal(int* argc, char*** argv,
     HandleCommandLineHelpFlags();   // may cause us to exit on --help, etc.
 
   // See if any of the unset flags fail their validation checks
+  if (validate_flags_in_parallel)
+    parser.ValidateInParallel();
   parser.ValidateUnmodifiedFlags();
 
   if (parser.ReportErrors())        // may cause us to exit on illegal flags
@@ -1975,6 +3916,36 @@ uint32 ParseCommandLineNonHelpFlags(int* argc, char*** argv,
   return ParseCommandLineFlagsInternal(argc, argv, remove_flags, false);
 }
 
+// --------------------------------------------------------------------
+// SetFlagfilePrefetching()
+// --------------------------------------------------------------------
+
+void SetFlagfilePrefetching(bool enable) {
+  prefetch_flagfiles = enable;
+}
+
+// --------------------------------------------------------------------
+// SetFlagAssignmentDeduplication()
+// GetNumSkippedFlagAssignments()
+// --------------------------------------------------------------------
+
+void SetFlagAssignmentDeduplication(bool enable) {
+  deduplicate_flag_assignments = enable;
+}
+
+uint64 GetNumSkippedFlagAssignments() {
+  FlagRegistryLock frl(FlagRegistry::GlobalRegistry());
+  return num_skipped_flag_assignments;
+}
+
+// --------------------------------------------------------------------
+// SetParallelFlagValidation()
+// --------------------------------------------------------------------
+
+void SetParallelFlagValidation(bool enable) {
+  validate_flags_in_parallel = enable;
+}
+
 // --------------------------------------------------------------------
 // AllowCommandLineReparsing()
 // ReparseCommandLineNonHelpFlags()
@@ -0,0 +1,59 @@
+// Copyright (c) 2008, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// ---
+
+// Compiles a text flagfile into a binary flagfile, which programs using
+// gflags can then load with --flagfile without parsing any text.  See
+// CompileFlagfile() in gflags.h.
+//
+// Usage: gflags_compile_flagfile <flagfile> <binary flagfile>
+
+#include <gflags/gflags.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+int main(int argc, char** argv) {
+  GFLAGS_NAMESPACE::SetUsageMessage(
+      "compiles a text flagfile into a binary one.  Usage:\n"
+      "  gflags_compile_flagfile <flagfile> <binary flagfile>");
+  GFLAGS_NAMESPACE::ParseCommandLineFlags(&argc, &argv, true);
+  if (argc != 3) {
+    fprintf(stderr, "%s\n", GFLAGS_NAMESPACE::ProgramUsage());
+    return 1;
+  }
+  if (!GFLAGS_NAMESPACE::CompileFlagfile(argv[1], argv[2])) {
+    fprintf(stderr, "ERROR: could not compile %s into %s: %s\n",
+            argv[1], argv[2], strerror(errno));
+    return 1;
+  }
+  return 0;
+}
@@ -98,14 +98,13 @@ static bool RemoveTrailingChar(string *str, char c);
 
 // 2) Find all matches
 static void FindMatchingFlags(
-    const vector<CommandLineFlagInfo> &all_flags,
     const CompletionOptions &options,
     const string &match_token,
-    set<const CommandLineFlagInfo *> *all_matches,
+    vector<CommandLineFlagInfo> *all_matches,
     string *longest_common_prefix);
 
 static bool DoesSingleFlagMatch(
-    const CommandLineFlagInfo &flag,
+    const CommandLineFlagView &flag,
     const CompletionOptions &options,
     const string &match_token);
 
@@ -119,7 +118,6 @@ static void CategorizeAllMatchingFlags(
     NotableFlags *notable_flags);
 
 static void TryFindModuleAndPackageDir(
-    const vector<CommandLineFlagInfo> &all_flags,
     string *module,
     string *package_dir);
 
@@ -215,18 +213,18 @@ static void PrintFlagCompletionInfo(void) {
 
   DVLOG(1) << "Identified canonical_token: '" << canonical_token << "'";
 
-  vector<CommandLineFlagInfo> all_flags;
-  set<const CommandLineFlagInfo *> matching_flags;
-  GetAllFlags(&all_flags);
-  DVLOG(2) << "Found " << all_flags.size() << " flags overall";
-
+  vector<CommandLineFlagInfo> all_matches;
   string longest_common_prefix;
   FindMatchingFlags(
-      all_flags,
       options,
       canonical_token,
-      &matching_flags,
+      &all_matches,
       &longest_common_prefix);
+  set<const CommandLineFlagInfo *> matching_flags;
+  for (vector<CommandLineFlagInfo>::const_iterator it = all_matches.begin();
+      it != all_matches.end();
+      ++it)
+    matching_flags.insert(&*it);
   DVLOG(1) << "Identified " << matching_flags.size() << " matching flags";
   DVLOG(1) << "Identified " << longest_common_prefix
           << " as longest common prefix.";
@@ -246,7 +244,7 @@ static void PrintFlagCompletionInfo(void) {
 
   string module;
   string package_dir;
-  TryFindModuleAndPackageDir(all_flags, &module, &package_dir);
+  TryFindModuleAndPackageDir(&module, &package_dir);
   DVLOG(1) << "Identified module: '" << module << "'";
   DVLOG(1) << "Identified package_dir: '" << package_dir << "'";
 
@@ -345,63 +343,81 @@ static bool RemoveTrailingChar(string *str, char c) {
 
 
 // 2) Find all matches (and helper methods)
+
+// Collects a CommandLineFlagInfo of each flag which matches, and the
+// longest common prefix of their names.  Only the matching flags,
+// which are usually few, are copied into a CommandLineFlagInfo.
+class MatchingFlagsCollector : public CommandLineFlagVisitor {
+ public:
+  MatchingFlagsCollector(const CompletionOptions *options,
+                         const string *match_token,
+                         vector<CommandLineFlagInfo> *all_matches,
+                         string *longest_common_prefix)
+      : options_(options), match_token_(match_token),
+        all_matches_(all_matches),
+        longest_common_prefix_(longest_common_prefix) { }
+
+  virtual void Visit(const CommandLineFlagView &flag) {
+    if (!DoesSingleFlagMatch(flag, *options_, *match_token_))
+      return;
+    const char *name = flag.name();
+    if (all_matches_->empty()) {
+      *longest_common_prefix_ = name;
+    } else {
+      string::size_type pos = 0;
+      while (pos < longest_common_prefix_->size() &&
+          name[pos] != '\0' &&
+          (*longest_common_prefix_)[pos] == name[pos])
+        ++pos;
+      longest_common_prefix_->erase(pos);
+    }
+    all_matches_->push_back(CommandLineFlagInfo());
+    flag.FillCommandLineFlagInfo(&all_matches_->back());
+  }
+
+ private:
+  const CompletionOptions *const options_;
+  const string *const match_token_;
+  vector<CommandLineFlagInfo> *const all_matches_;
+  string *const longest_common_prefix_;
+};
+
 static void FindMatchingFlags(
-    const vector<CommandLineFlagInfo> &all_flags,
     const CompletionOptions &options,
     const string &match_token,
-    set<const CommandLineFlagInfo *> *all_matches,
+    vector<CommandLineFlagInfo> *all_matches,
     string *longest_common_prefix) {
   all_matches->clear();
-  bool first_match = true;
-  for (vector<CommandLineFlagInfo>::const_iterator it = all_flags.begin();
-      it != all_flags.end();
-      ++it) {
-    if (DoesSingleFlagMatch(*it, options, match_token)) {
-      all_matches->insert(&*it);
-      if (first_match) {
-        first_match = false;
-        *longest_common_prefix = it->name;
-      } else {
-        if (longest_common_prefix->empty() || it->name.empty()) {
-          longest_common_prefix->clear();
-          continue;
-        }
-        string::size_type pos = 0;
-        while (pos < longest_common_prefix->size() &&
-            pos < it->name.size() &&
-            (*longest_common_prefix)[pos] == it->name[pos])
-          ++pos;
-        longest_common_prefix->erase(pos);
-      }
-    }
-  }
+  MatchingFlagsCollector collector(&options, &match_token,
+                                   all_matches, longest_common_prefix);
+  VisitAllFlags(&collector);
 }
 
 // Given the set of all flags, the parsed match options, and the
 // canonical search token, produce the set of all candidate matching
 // flags for subsequent analysis or filtering.
 static bool DoesSingleFlagMatch(
-    const CommandLineFlagInfo &flag,
+    const CommandLineFlagView &flag,
     const CompletionOptions &options,
     const string &match_token) {
   // Is there a prefix match?
-  string::size_type pos = flag.name.find(match_token);
-  if (pos == 0) return true;
+  if (strncmp(flag.name(), match_token.c_str(), match_token.size()) == 0)
+    return true;
 
   // Is there a substring match if we want it?
   if (options.flag_name_substring_search &&
-      pos != string::npos)
+      strstr(flag.name(), match_token.c_str()) != NULL)
     return true;
 
   // Is there a location match if we want it?
   if (options.flag_location_substring_search &&
-      flag.filename.find(match_token) != string::npos)
+      strstr(flag.filename(), match_token.c_str()) != NULL)
     return true;
 
   // TODO(user): All searches should probably be case-insensitive
   // (especially this one...)
   if (options.flag_description_substring_search &&
-      flag.description.find(match_token) != string::npos)
+      strstr(flag.description(), match_token.c_str()) != NULL)
     return true;
 
   return false;
@@ -467,8 +483,33 @@ static void PushNameWithSuffix(vector<string>* suffixes, const char* suffix) {
       StringPrintf("/%s%s", ProgramInvocationShortName(), suffix));
 }
 
+// Finds the first flag file whose name contains one of the suffixes,
+// which TryFindModuleAndPackageDir() takes for the module.
+class ModuleFinder : public CommandLineFlagVisitor {
+ public:
+  ModuleFinder(const vector<string> *suffixes, string *module)
+      : suffixes_(suffixes), module_(module) { }
+
+  virtual void Visit(const CommandLineFlagView &flag) {
+    if (!module_->empty())
+      return;
+    for (vector<string>::const_iterator suffix = suffixes_->begin();
+        suffix != suffixes_->end();
+        ++suffix) {
+      // TODO(user): Make sure the match is near the end of the string
+      if (strstr(flag.filename(), suffix->c_str()) != NULL) {
+        *module_ = flag.filename();
+        return;
+      }
+    }
+  }
+
+ private:
+  const vector<string> *const suffixes_;
+  string *const module_;
+};
+
 static void TryFindModuleAndPackageDir(
-    const vector<CommandLineFlagInfo> &all_flags,
     string *module,
     string *package_dir) {
   module->clear();
@@ -488,20 +529,11 @@ static void TryFindModuleAndPackageDir(
   PushNameWithSuffix(&suffixes, "-unittest.");
   PushNameWithSuffix(&suffixes, "_unittest.");
 
-  for (vector<CommandLineFlagInfo>::const_iterator it = all_flags.begin();
-      it != all_flags.end();
-      ++it) {
-    for (vector<string>::const_iterator suffix = suffixes.begin();
-        suffix != suffixes.end();
-        ++suffix) {
-      // TODO(user): Make sure the match is near the end of the string
-      if (it->filename.find(*suffix) != string::npos) {
-        *module = it->filename;
-        string::size_type sep = it->filename.rfind(PATH_SEPARATOR);
-        *package_dir = it->filename.substr(0, (sep == string::npos) ? 0 : sep);
-        return;
-      }
-    }
+  ModuleFinder finder(&suffixes, module);
+  VisitAllFlags(&finder);
+  if (!module->empty()) {
+    string::size_type sep = module->rfind(PATH_SEPARATOR);
+    *package_dir = module->substr(0, (sep == string::npos) ? 0 : sep);
   }
 }
 
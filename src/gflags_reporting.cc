@@ -83,8 +83,8 @@ using std::vector;
 // DescribeOneFlag()
 // DescribeOneFlagInXML()
 //    Routines that pretty-print info about a flag.  These use
-//    a CommandLineFlagInfo, which is the way the gflags
-//    API exposes static info about a flag.
+//    a CommandLineFlagInfo or a CommandLineFlagView, which are the
+//    ways the gflags API exposes static info about a flag.
 // --------------------------------------------------------------------
 
 static const int kLineLength = 80;
@@ -103,24 +103,24 @@ static void AddString(const string& s,
   *chars_in_line += slen;
 }
 
-static string PrintStringFlagsWithQuotes(const CommandLineFlagInfo& flag,
-                                         const string& text, bool current) {
-  const char* c_string = (current ? flag.current_value.c_str() :
-                          flag.default_value.c_str());
-  if (strcmp(flag.type.c_str(), "string") == 0) {  // add quotes for strings
+static string PrintStringFlagsWithQuotes(const char* type,
+                                         const string& text,
+                                         const string& value) {
+  const char* c_string = value.c_str();
+  if (strcmp(type, "string") == 0) {  // add quotes for strings
     return StringPrintf("%s: \"%s\"", text.c_str(), c_string);
   } else {
     return StringPrintf("%s: %s", text.c_str(), c_string);
   }
 }
 
-// Create a descriptive string for a flag.
-// Goes to some trouble to make pretty line breaks.
-string DescribeOneFlag(const CommandLineFlagInfo& flag) {
+// Does the work of both DescribeOneFlag()s.  current_value is NULL if
+// the flag has its default value.
+static string DescribeFlag(const char* name, const char* description,
+                           const char* type, const string& default_value,
+                           const string* current_value) {
   string main_part;
-  SStringPrintf(&main_part, "    -%s (%s)",
-                flag.name.c_str(),
-                flag.description.c_str());
+  SStringPrintf(&main_part, "    -%s (%s)", name, description);
   const char* c_string = main_part.c_str();
   int chars_left = static_cast<int>(main_part.length());
   string final_string;
@@ -166,15 +166,15 @@ string DescribeOneFlag(const CommandLineFlagInfo& flag) {
   }
 
   // Append data type
-  AddString(string("type: ") + flag.type, &final_string, &chars_in_line);
+  AddString(string("type: ") + type, &final_string, &chars_in_line);
   // The listed default value will be the actual default from the flag
   // definition in the originating source file, unless the value has
   // subsequently been modified using SetCommandLineOptionWithMode() with mode
   // SET_FLAGS_DEFAULT, or by setting FLAGS_foo = bar before ParseCommandLineFlags().
-  AddString(PrintStringFlagsWithQuotes(flag, "default", false), &final_string,
-            &chars_in_line);
-  if (!flag.is_default) {
-    AddString(PrintStringFlagsWithQuotes(flag, "currently", true),
+  AddString(PrintStringFlagsWithQuotes(type, "default", default_value),
+            &final_string, &chars_in_line);
+  if (current_value != NULL) {
+    AddString(PrintStringFlagsWithQuotes(type, "currently", *current_value),
               &final_string, &chars_in_line);
   }
 
@@ -182,6 +182,25 @@ string DescribeOneFlag(const CommandLineFlagInfo& flag) {
   return final_string;
 }
 
+// Create a descriptive string for a flag.
+// Goes to some trouble to make pretty line breaks.
+string DescribeOneFlag(const CommandLineFlagInfo& flag) {
+  return DescribeFlag(flag.name.c_str(), flag.description.c_str(),
+                      flag.type.c_str(), flag.default_value,
+                      flag.is_default ? NULL : &flag.current_value);
+}
+
+// The same for a view, which formats only the values we show.
+static string DescribeOneFlag(const CommandLineFlagView& flag) {
+  string default_value, current_value;
+  flag.AppendDefaultValue(&default_value);
+  const bool is_default = flag.is_default();
+  if (!is_default)
+    flag.AppendCurrentValue(&current_value);
+  return DescribeFlag(flag.name(), flag.description(), flag.type(),
+                      default_value, is_default ? NULL : &current_value);
+}
+
 // Simple routine to xml-escape a string: escape & and < only.
 static string XMLText(const string& txt) {
   string ans = txt;
@@ -197,17 +216,20 @@ static void AddXMLTag(string* r, const char* tag, const string& txt) {
 }
 
 
-static string DescribeOneFlagInXML(const CommandLineFlagInfo& flag) {
+static string DescribeOneFlagInXML(const CommandLineFlagView& flag) {
   // The file and flagname could have been attributes, but default
   // and meaning need to avoid attribute normalization.  This way it
   // can be parsed by simple programs, in addition to xml parsers.
+  string default_value, current_value;
+  flag.AppendDefaultValue(&default_value);
+  flag.AppendCurrentValue(&current_value);
   string r("<flag>");
-  AddXMLTag(&r, "file", flag.filename);
-  AddXMLTag(&r, "name", flag.name);
-  AddXMLTag(&r, "meaning", flag.description);
-  AddXMLTag(&r, "default", flag.default_value);
-  AddXMLTag(&r, "current", flag.current_value);
-  AddXMLTag(&r, "type", flag.type);
+  AddXMLTag(&r, "file", flag.filename());
+  AddXMLTag(&r, "name", flag.name());
+  AddXMLTag(&r, "meaning", flag.description());
+  AddXMLTag(&r, "default", default_value);
+  AddXMLTag(&r, "current", current_value);
+  AddXMLTag(&r, "type", flag.type());
   r += "</flag>";
   return r;
 }
@@ -236,25 +258,67 @@ static string Dirname(const string& filename) {
 }
 
 // Test whether a filename contains at least one of the substrings.
-static bool FileMatchesSubstring(const string& filename,
+static bool FileMatchesSubstring(const char* filename,
                                  const vector<string>& substrings) {
   for (vector<string>::const_iterator target = substrings.begin();
        target != substrings.end();
        ++target) {
-    if (strstr(filename.c_str(), target->c_str()) != NULL)
+    if (strstr(filename, target->c_str()) != NULL)
       return true;
     // If the substring starts with a '/', that means that we want
     // the string to be at the beginning of a directory component.
     // That should match the first directory component as well, so
     // we allow '/foo' to match a filename of 'foo'.
     if (!target->empty() && (*target)[0] == PATH_SEPARATOR &&
-        strncmp(filename.c_str(), target->c_str() + 1,
+        strncmp(filename, target->c_str() + 1,
                 strlen(target->c_str() + 1)) == 0)
       return true;
   }
   return false;
 }
 
+// Describes the flags from every filename which matches any of the
+// target substrings, or of every file if substrings is empty.  The
+// flags are locked while it visits them, so it only collects the
+// output, and leaves printing it to the caller.
+class UsageCollector : public CommandLineFlagVisitor {
+ public:
+  explicit UsageCollector(const vector<string>* substrings)
+      : substrings_(substrings), first_directory_(true),
+        found_match_(false) { }
+
+  virtual void Visit(const CommandLineFlagView& flag) {
+    const char* const filename = flag.filename();
+    if (!substrings_->empty() &&
+        !FileMatchesSubstring(filename, *substrings_))
+      return;
+    found_match_ = true;     // this flag passed the match!
+    // If the flag has been stripped, pretend that it doesn't exist.
+    if (strcmp(flag.description(), kStrippedFlagHelp) == 0) return;
+    if (last_filename_ != filename) {                          // new file
+      if (Dirname(filename) != Dirname(last_filename_)) {      // new dir!
+        if (!first_directory_)
+          usage_ += "\n\n";   // put blank lines between directories
+        first_directory_ = false;
+      }
+      StringAppendF(&usage_, "\n  Flags from %s:\n", filename);
+      last_filename_ = filename;
+    }
+    // Now describe this flag
+    usage_ += DescribeOneFlag(flag);
+  }
+
+  const string& usage() const { return usage_; }
+  bool found_match() const { return found_match_; }
+
+ private:
+  const vector<string>* const substrings_;
+  string usage_;
+  string last_filename_;   // so we know when we're at a new file
+  bool first_directory_;   // controls blank lines between dirs
+  bool found_match_;       // stays false iff no dir matches restrict
+};
+
 // Show help for every filename which matches any of the target substrings.
 // If substrings is empty, shows help for every file. If a flag's help message
 // has been stripped (e.g. by adding '#define STRIP_FLAG_HELP 1'
@@ -264,34 +328,10 @@ static void ShowUsageWithFlagsMatching(const char *argv0,
                                        const vector<string> &substrings) {
   fprintf(stdout, "%s: %s\n", Basename(argv0), ProgramUsage());
 
-  vector<CommandLineFlagInfo> flags;
-  GetAllFlags(&flags);           // flags are sorted by filename, then flagname
-
-  string last_filename;          // so we know when we're at a new file
-  bool first_directory = true;   // controls blank lines between dirs
-  bool found_match = false;      // stays false iff no dir matches restrict
-  for (vector<CommandLineFlagInfo>::const_iterator flag = flags.begin();
-       flag != flags.end();
-       ++flag) {
-    if (substrings.empty() ||
-        FileMatchesSubstring(flag->filename, substrings)) {
-      found_match = true;     // this flag passed the match!
-      // If the flag has been stripped, pretend that it doesn't exist.
-      if (flag->description == kStrippedFlagHelp) continue;
-      if (flag->filename != last_filename) {                      // new file
-        if (Dirname(flag->filename) != Dirname(last_filename)) {  // new dir!
-          if (!first_directory)
-            fprintf(stdout, "\n\n");   // put blank lines between directories
-          first_directory = false;
-        }
-        fprintf(stdout, "\n  Flags from %s:\n", flag->filename.c_str());
-        last_filename = flag->filename;
-      }
-      // Now print this flag
-      fprintf(stdout, "%s", DescribeOneFlag(*flag).c_str());
-    }
-  }
-  if (!found_match && !substrings.empty()) {
+  UsageCollector collector(&substrings);
+  VisitAllFlags(&collector);   // flags are sorted by filename, then flagname
+  fputs(collector.usage().c_str(), stdout);
+  if (!collector.found_match() && !substrings.empty()) {
     fprintf(stdout, "\n  No modules matched: use -help\n");
   }
 }
@@ -308,10 +348,27 @@ void ShowUsageWithFlags(const char *argv0) {
   ShowUsageWithFlagsRestrict(argv0, "");
 }
 
+// Describes each flag in xml, on a line of its own, but for the
+// flags whose help has been stripped.
+class XMLCollector : public CommandLineFlagVisitor {
+ public:
+  virtual void Visit(const CommandLineFlagView& flag) {
+    if (strcmp(flag.description(), kStrippedFlagHelp) != 0) {
+      xml_ += DescribeOneFlagInXML(flag);
+      xml_ += '\n';
+    }
+  }
+
+  const string& xml() const { return xml_; }
+
+ private:
+  string xml_;
+};
+
 // Convert the help, program, and usage to xml.
 static void ShowXMLOfFlags(const char *prog_name) {
-  vector<CommandLineFlagInfo> flags;
-  GetAllFlags(&flags);   // flags are sorted: by filename, then flagname
+  XMLCollector collector;
+  VisitAllFlags(&collector);   // flags are sorted: by filename, then flagname
 
   // XML.  There is no corresponding schema yet
   fprintf(stdout, "<?xml version=\"1.0\"?>\n");
@@ -323,12 +380,7 @@ static void ShowXMLOfFlags(const char *prog_name) {
   fprintf(stdout, "<usage>%s</usage>\n",
           XMLText(ProgramUsage()).c_str());
   // All the flags
-  for (vector<CommandLineFlagInfo>::const_iterator flag = flags.begin();
-       flag != flags.end();
-       ++flag) {
-    if (flag->description != kStrippedFlagHelp)
-      fprintf(stdout, "%s\n", DescribeOneFlagInXML(*flag).c_str());
-  }
+  fputs(collector.xml().c_str(), stdout);
   // The end of the document
   fprintf(stdout, "</AllFlags>\n");
 }
@@ -351,6 +403,29 @@ static void ShowVersion() {
 # endif
 }
 
+// Collects the package (the directory, with a trailing separator) of
+// each file which matches any of the substrings, in the order of the
+// flags, but once for each run of flags from the same package.
+class PackageCollector : public CommandLineFlagVisitor {
+ public:
+  explicit PackageCollector(const vector<string>* substrings)
+      : substrings_(substrings) { }
+
+  virtual void Visit(const CommandLineFlagView& flag) {
+    if (!FileMatchesSubstring(flag.filename(), *substrings_))
+      return;
+    const string package = Dirname(flag.filename()) + PATH_SEPARATOR;
+    if (packages_.empty() || package != packages_.back())
+      packages_.push_back(package);
+  }
+
+  const vector<string>& packages() const { return packages_; }
+
+ private:
+  const vector<string>* const substrings_;
+  vector<string> packages_;
+};
+
 static void AppendPrognameStrings(vector<string>* substrings,
                                   const char* progname) {
   string r;
@@ -403,23 +478,19 @@ void HandleCommandLineHelpFlags() {
     // the user can pick progname, and it may not relate to the file
     // where main() resides.  So instead, we search the flags for a
     // filename like "/progname.cc", and take the dirname of that.
-    vector<CommandLineFlagInfo> flags;
-    GetAllFlags(&flags);
+    PackageCollector collector(&substrings);
+    VisitAllFlags(&collector);
     string last_package;
-    for (vector<CommandLineFlagInfo>::const_iterator flag = flags.begin();
-         flag != flags.end();
-         ++flag) {
-      if (!FileMatchesSubstring(flag->filename, substrings))
-        continue;
-      const string package = Dirname(flag->filename) + PATH_SEPARATOR;
-      if (package != last_package) {
-        ShowUsageWithFlagsRestrict(progname, package.c_str());
-        VLOG(7) << "Found package: " << package;
-        if (!last_package.empty()) {      // means this isn't our first pkg
-          LOG(WARNING) << "Multiple packages contain a file=" << progname;
-        }
-        last_package = package;
+    for (vector<string>::const_iterator package =
+             collector.packages().begin();
+         package != collector.packages().end();
+         ++package) {
+      ShowUsageWithFlagsRestrict(progname, package->c_str());
+      VLOG(7) << "Found package: " << *package;
+      if (!last_package.empty()) {      // means this isn't our first pkg
+        LOG(WARNING) << "Multiple packages contain a file=" << progname;
       }
+      last_package = *package;
     }
     if (last_package.empty()) {   // never found a package to print
       LOG(WARNING) << "Unable to find a package for file=" << progname;
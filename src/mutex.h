@@ -299,6 +299,111 @@ void Mutex::ReaderUnlock() { Unlock(); }
 
 #endif
 
+// --------------------------------------------------------------------------
+// ReaderBiasedMutex
+//
+// A read-write lock with the same interface as Mutex that is split into
+// several shards, each on its own cache lines.  A reader only acquires
+// the shard picked by its thread id, so readers on different cores do
+// not fight over a single lock word.  A writer acquires every shard (in
+// order, so writers can't deadlock each other), which makes writing a
+// lot more expensive.  Only use this for locks that are mostly read.
+
+class ReaderBiasedMutex {
+ public:
+  inline ReaderBiasedMutex() { }
+
+  inline void Lock() {
+    for (int i = 0; i < kNumShards; ++i) shards_[i].mu.Lock();
+  }
+  inline void Unlock() {
+    for (int i = kNumShards - 1; i >= 0; --i) shards_[i].mu.Unlock();
+  }
+  inline void ReaderLock()   { shards_[CurrentShard()].mu.ReaderLock(); }
+  inline void ReaderUnlock() { shards_[CurrentShard()].mu.ReaderUnlock(); }
+  inline void WriterLock() { Lock(); }
+  inline void WriterUnlock() { Unlock(); }
+
+ private:
+  enum { kNumShards = 16, kCacheLineSize = 64 };
+
+  struct Shard {
+    Mutex mu;
+    char padding[kCacheLineSize];   // keeps neighbouring locks apart
+  };
+  Shard shards_[kNumShards];
+
+  // Returns the shard for the calling thread.  A given thread always
+  // gets the same shard, so ReaderUnlock() releases what ReaderLock()
+  // acquired.
+  static inline int CurrentShard();
+
+  // Disallow "evil" constructors
+  ReaderBiasedMutex(const ReaderBiasedMutex&);
+  void operator=(const ReaderBiasedMutex&);
+};
+
+#if defined(NO_THREADS)
+int ReaderBiasedMutex::CurrentShard() { return 0; }
+#elif defined(OS_WINDOWS)
+int ReaderBiasedMutex::CurrentShard() {
+  return static_cast<int>(GetCurrentThreadId() % kNumShards);
+}
+#else
+int ReaderBiasedMutex::CurrentShard() {
+  // pthread_t is opaque, so hash its bytes (FNV-1a).
+  const pthread_t self = pthread_self();
+  const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&self);
+  unsigned int hash = 2166136261u;
+  for (size_t i = 0; i < sizeof(self); ++i) {
+    hash ^= bytes[i];
+    hash *= 16777619u;
+  }
+  return static_cast<int>(hash % kNumShards);
+}
+#endif
+
+// --------------------------------------------------------------------------
+// Atomic pointer access
+//
+// AcquireLoad() reads a pointer that another thread may publish with
+// ReleaseStore().  Whatever the publishing thread wrote before the store
+// is visible to a thread that sees the new value via AcquireLoad().  This
+// is just enough for double-checked initialization of a singleton.  If
+// we don't know how to do this on a platform, GMUTEX_ATOMIC_POINTER is
+// left undefined, and callers have to take a Mutex instead.
+
+#if defined(NO_THREADS)
+# define GMUTEX_ATOMIC_POINTER
+template <typename T>
+inline T* AcquireLoad(T* const* ptr) { return *ptr; }
+template <typename T>
+inline void ReleaseStore(T** ptr, T* value) { *ptr = value; }
+#elif defined(__ATOMIC_ACQUIRE)   // gcc >= 4.7 and clang
+# define GMUTEX_ATOMIC_POINTER
+template <typename T>
+inline T* AcquireLoad(T* const* ptr) {
+  return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+}
+template <typename T>
+inline void ReleaseStore(T** ptr, T* value) {
+  __atomic_store_n(ptr, value, __ATOMIC_RELEASE);
+}
+#elif defined(OS_WINDOWS)
+# define GMUTEX_ATOMIC_POINTER
+template <typename T>
+inline T* AcquireLoad(T* const* ptr) {
+  T* const value = *const_cast<T* const volatile*>(ptr);
+  MemoryBarrier();
+  return value;
+}
+template <typename T>
+inline void ReleaseStore(T** ptr, T* value) {
+  MemoryBarrier();
+  *const_cast<T* volatile*>(ptr) = value;
+}
+#endif
+
 // --------------------------------------------------------------------------
 // Some helper classes
 
@@ -46,6 +46,9 @@
 #include <iostream>
 #include <string>
 #include <errno.h>
+#include <float.h>      // for FLT_EVAL_METHOD
+#include <locale.h>     // for localeconv
+#include <string.h>
 #ifdef HAVE_SYS_STAT_H
 #  include <sys/stat.h> // for mkdir
 #endif
@@ -338,6 +341,381 @@ inline std::string StringPrintf(const char* format, ...) {
   return output;
 }
 
+// -- number parsing ---------------------------------------------------------
+//
+// These accept the same syntax as the strtoXXX() routines gflags used to
+// call, minus the locale: integers are decimal, or hexadecimal with a
+// leading "0x" (but never octal), and doubles always use '.' as decimal
+// point.  Each returns false unless the whole string is a number in range.
+
+inline bool IsAsciiDigit(char c) {
+  return static_cast<unsigned char>(c - '0') < 10;
+}
+
+inline bool IsAsciiSpace(char c) {
+  return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+inline int HexDigitValue(char c) {
+  if (IsAsciiDigit(c)) return c - '0';
+  c |= 0x20;  // lower case
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  return -1;
+}
+
+// Parses a string of decimal digits with nothing before or after them.
+// Nineteen significant digits always fit into a uint64, so only the
+// twentieth needs an overflow check.
+inline bool ParseDecimalDigits(const char* p, uint64* out) {
+  const char* const start = p;
+  while (*p == '0') ++p;
+  const char* const first = p;
+  uint64 value = 0;
+  while (IsAsciiDigit(*p) && p - first < 19) {
+    value = value * 10 + static_cast<unsigned>(*p - '0');
+    ++p;
+  }
+  if (IsAsciiDigit(*p)) {
+    const uint64 digit = static_cast<unsigned>(*p - '0');
+    if (value > (~static_cast<uint64>(0) - digit) / 10) return false;
+    value = value * 10 + digit;
+    if (IsAsciiDigit(*++p)) return false;
+  }
+  if (p == start || *p != '\0') return false;
+  *out = value;
+  return true;
+}
+
+// Parses a string of hexadecimal digits with nothing before or after them.
+inline bool ParseHexDigits(const char* p, uint64* out) {
+  const char* const start = p;
+  while (*p == '0') ++p;
+  const char* const first = p;
+  uint64 value = 0;
+  int digit;
+  while ((digit = HexDigitValue(*p)) >= 0) {
+    if (p - first == 16) return false;  // more than 64 bits
+    value = (value << 4) | static_cast<unsigned>(digit);
+    ++p;
+  }
+  if (p == start || *p != '\0') return false;
+  *out = value;
+  return true;
+}
+
+// Parses an optionally signed number into its magnitude, skipping leading
+// white space like strtoll() does.  A leading "0x" selects base 16, in
+// which case neither white space nor a sign may precede it.
+inline bool ParseMagnitude(const char* str, bool* negative, uint64* out) {
+  *negative = false;
+  if (str[0] == '0' && (str[1] == 'x' || str[1] == 'X')) {
+    return ParseHexDigits(str + 2, out);
+  }
+  while (IsAsciiSpace(*str)) ++str;
+  if (*str == '-' || *str == '+') *negative = (*str++ == '-');
+  return ParseDecimalDigits(str, out);
+}
+
+inline bool ParseInt64(const char* str, int64* out) {
+  bool negative;
+  uint64 magnitude;
+  if (!ParseMagnitude(str, &negative, &magnitude)) return false;
+  const uint64 limit = (static_cast<uint64>(1) << 63) - (negative ? 0 : 1);
+  if (magnitude > limit) return false;
+  *out = negative ? static_cast<int64>(0 - magnitude)
+                  : static_cast<int64>(magnitude);
+  return true;
+}
+
+// Like strtoull(), a negative number wraps around.  Callers that do not
+// want this must reject the minus sign themselves.
+inline bool ParseUint64(const char* str, uint64* out) {
+  bool negative;
+  uint64 magnitude;
+  if (!ParseMagnitude(str, &negative, &magnitude)) return false;
+  *out = negative ? 0 - magnitude : magnitude;
+  return true;
+}
+
+// Fallback for the doubles ParseDouble() cannot convert exactly itself.
+// strtod() expects the decimal point of the current locale, so swap it in.
+inline bool ParseDoubleWithStrtod(const char* str, double* out) {
+  const char* const point = localeconv()->decimal_point;
+  std::string localized;
+  if (point[0] != '.' || point[1] != '\0') {
+    if (strstr(str, point) != NULL) return false;  // not our decimal point
+    localized = str;
+    for (size_t pos = 0; (pos = localized.find('.', pos)) != std::string::npos;
+         pos += strlen(point)) {
+      localized.replace(pos, 1, point);
+    }
+    str = localized.c_str();
+  }
+  const int saved_errno = errno;
+  errno = 0;
+  char* end;
+  const double value = strtod(str, &end);
+  const bool ok = (errno == 0 && end != str && *end == '\0');
+  errno = saved_errno;
+  if (ok) *out = value;
+  return ok;
+}
+
+// The double conversions below rely on IEEE double arithmetic, in which
+// the powers of ten up to 1e22 are exact.  Their fast paths need plain
+// double precision arithmetic, which x87 code does not provide.
+#if (defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0) || \
+    (defined(__FLT_EVAL_METHOD__) && __FLT_EVAL_METHOD__ == 0)
+#  define HAVE_DOUBLE_PRECISION_ARITHMETIC
+#endif
+
+static const double kExactPowersOfTen[] = {
+  1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+// Integers up to this magnitude are exact as doubles.  It must stay a
+// uint64: comparing a mantissa of 2^53 + 1 with the double 2^53 would
+// round the mantissa down to 2^53 first.
+static const uint64 kMaxExactMantissa = static_cast<uint64>(1) << 53;
+
+// Converts numbers with at most 19 significant digits and a decimal
+// exponent of at most 22 with a single, correctly rounded floating-point
+// operation (Clinger's fast path); everything else, including hexadecimal
+// floats, infinities and NaNs, is left to strtod().
+inline bool ParseDouble(const char* str, double* out) {
+#ifdef HAVE_DOUBLE_PRECISION_ARITHMETIC
+  const char* p = str;
+  while (IsAsciiSpace(*p)) ++p;
+  const bool negative = (*p == '-');
+  if (*p == '-' || *p == '+') ++p;
+  uint64 mantissa = 0;
+  int num_digits = 0;   // significant digits in mantissa
+  int exponent = 0;
+  bool any_digits = false;
+  for (; IsAsciiDigit(*p); ++p) {
+    any_digits = true;
+    if (mantissa == 0 && *p == '0') continue;
+    if (++num_digits > 19) return ParseDoubleWithStrtod(str, out);
+    mantissa = mantissa * 10 + static_cast<unsigned>(*p - '0');
+  }
+  if (*p == '.') {
+    for (++p; IsAsciiDigit(*p); ++p) {
+      any_digits = true;
+      --exponent;
+      if (mantissa == 0 && *p == '0') continue;
+      if (++num_digits > 19) return ParseDoubleWithStrtod(str, out);
+      mantissa = mantissa * 10 + static_cast<unsigned>(*p - '0');
+    }
+  }
+  if (!any_digits) return ParseDoubleWithStrtod(str, out);
+  if (*p == 'e' || *p == 'E') {
+    ++p;
+    const bool negative_exponent = (*p == '-');
+    if (*p == '-' || *p == '+') ++p;
+    if (!IsAsciiDigit(*p)) return ParseDoubleWithStrtod(str, out);
+    int e = 0;
+    for (; IsAsciiDigit(*p); ++p) {
+      if (e < 100000) e = e * 10 + (*p - '0');
+    }
+    exponent += negative_exponent ? -e : e;
+  }
+  if (*p != '\0') return ParseDoubleWithStrtod(str, out);
+  if (mantissa == 0) {
+    *out = negative ? -0.0 : 0.0;
+    return true;
+  }
+  // Converting a uint64 to double rounds correctly, so the mantissa only
+  // has to be exact if it is to be scaled afterwards.
+  if (exponent != 0 && (mantissa > kMaxExactMantissa ||
+                        exponent < -22 || exponent > 22)) {
+    return ParseDoubleWithStrtod(str, out);
+  }
+  double value = static_cast<double>(mantissa);
+  if (exponent < 0) {
+    value /= kExactPowersOfTen[-exponent];
+  } else {
+    value *= kExactPowersOfTen[exponent];
+  }
+  *out = negative ? -value : value;
+  return true;
+#else
+  return ParseDoubleWithStrtod(str, out);
+#endif
+}
+
+// -- number formatting ------------------------------------------------------
+//
+// These write a number and a terminating '\0' to a buffer of at least
+// kFastToBufferSize chars and return a pointer to the '\0'.  Like the
+// number parsing routines above, they ignore the locale.
+
+static const int kFastToBufferSize = 32;
+
+inline char* FormatUint64(uint64 value, char* buffer) {
+  static const char kDigitPairs[] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+  char digits[20];
+  char* p = digits + sizeof(digits);
+  while (value >= 100) {
+    const size_t pair = static_cast<size_t>(value % 100) * 2;
+    value /= 100;
+    *--p = kDigitPairs[pair + 1];
+    *--p = kDigitPairs[pair];
+  }
+  if (value >= 10) {
+    const size_t pair = static_cast<size_t>(value) * 2;
+    *--p = kDigitPairs[pair + 1];
+    *--p = kDigitPairs[pair];
+  } else {
+    *--p = static_cast<char>('0' + value);
+  }
+  const size_t length = digits + sizeof(digits) - p;
+  memcpy(buffer, p, length);
+  buffer[length] = '\0';
+  return buffer + length;
+}
+
+inline char* FormatInt64(int64 value, char* buffer) {
+  uint64 magnitude = static_cast<uint64>(value);
+  if (value < 0) {
+    *buffer++ = '-';
+    magnitude = 0 - magnitude;
+  }
+  return FormatUint64(magnitude, buffer);
+}
+
+// Writes the decimal mantissa * 10^-scale like printf("%.17g") would,
+// which is the format gflags has always used for doubles.
+inline char* FormatDecimal(bool negative, uint64 mantissa, int scale,
+                           char* buffer) {
+  if (negative) *buffer++ = '-';
+  while (mantissa != 0 && mantissa % 10 == 0) {
+    mantissa /= 10;
+    --scale;
+  }
+  char digits[kFastToBufferSize];
+  const int num_digits = static_cast<int>(FormatUint64(mantissa, digits) -
+                                          digits);
+  const int exponent = num_digits - 1 - scale;
+  char* p = buffer;
+  if (exponent < -4 || exponent >= 17) {
+    *p++ = digits[0];
+    if (num_digits > 1) {
+      *p++ = '.';
+      memcpy(p, digits + 1, num_digits - 1);
+      p += num_digits - 1;
+    }
+    *p++ = 'e';
+    *p++ = exponent < 0 ? '-' : '+';
+    const int magnitude = exponent < 0 ? -exponent : exponent;
+    if (magnitude < 10) *p++ = '0';
+    return FormatUint64(magnitude, p);
+  }
+  if (scale <= 0) {               // an integer
+    memcpy(p, digits, num_digits);
+    p += num_digits;
+    memset(p, '0', -scale);
+    p += -scale;
+  } else if (exponent >= 0) {     // digits before and after the point
+    memcpy(p, digits, exponent + 1);
+    p += exponent + 1;
+    *p++ = '.';
+    memcpy(p, digits + exponent + 1, num_digits - exponent - 1);
+    p += num_digits - exponent - 1;
+  } else {                        // 0.000ddd
+    *p++ = '0';
+    *p++ = '.';
+    memset(p, '0', -exponent - 1);
+    p += -exponent - 1;
+    memcpy(p, digits, num_digits);
+    p += num_digits;
+  }
+  *p = '\0';
+  return p;
+}
+
+// Returns whether the decimal mantissa * 10^-scale reads back as value.
+inline bool DecimalReadsBackAs(uint64 mantissa, int scale, double value) {
+#ifdef HAVE_DOUBLE_PRECISION_ARITHMETIC
+  while (mantissa != 0 && mantissa % 10 == 0) {
+    mantissa /= 10;
+    --scale;
+  }
+  if (mantissa <= kMaxExactMantissa && scale >= -22 && scale <= 22) {
+    const double m = static_cast<double>(mantissa);
+    return (scale < 0 ? m * kExactPowersOfTen[-scale]
+                      : m / kExactPowersOfTen[scale]) == value;
+  }
+#endif
+  char text[kFastToBufferSize];
+  FormatDecimal(false, mantissa, scale, text);
+  double parsed;
+  return ParseDouble(text, &parsed) && parsed == value;
+}
+
+// Fallback for the doubles FormatDouble() cannot format itself.  Takes
+// the 17 significant digits which always read back as value from
+// snprintf(), and returns them rounded to 15 or 16 digits if those still
+// read back as value.
+inline char* FormatDoubleWithSnprintf(double value, char* buffer) {
+  if (value - value != 0) {   // inf or nan
+    snprintf(buffer, kFastToBufferSize, "%.17g", value);
+    return buffer + strlen(buffer);
+  }
+  char text[kFastToBufferSize];
+  snprintf(text, sizeof(text), "%.16e", value);
+  const bool negative = (text[0] == '-');
+  uint64 mantissa = 0;
+  const char* p = text + (negative ? 1 : 0);
+  for (; *p != 'e'; ++p) {    // skips the locale's decimal point
+    if (IsAsciiDigit(*p)) mantissa = mantissa * 10 + (*p - '0');
+  }
+  const int scale = 16 - atoi(p + 1);
+  const double magnitude = negative ? -value : value;
+  for (int dropped = 2; dropped > 0; --dropped) {
+    const uint64 divisor = dropped == 2 ? 100 : 10;
+    const uint64 lower = mantissa / divisor;
+    if (mantissa % divisor == 0)  // the same decimal, with fewer zeros
+      return FormatDecimal(negative, lower, scale - dropped, buffer);
+    // Try the nearer of the two neighbours first.
+    const bool round_up = (mantissa % divisor) * 2 >= divisor;
+    const uint64 first = round_up ? lower + 1 : lower;
+    const uint64 second = round_up ? lower : lower + 1;
+    if (DecimalReadsBackAs(first, scale - dropped, magnitude))
+      return FormatDecimal(negative, first, scale - dropped, buffer);
+    if (DecimalReadsBackAs(second, scale - dropped, magnitude))
+      return FormatDecimal(negative, second, scale - dropped, buffer);
+  }
+  return FormatDecimal(negative, mantissa, scale, buffer);
+}
+
+// Writes the shortest decimal which reads back as value.  If value * 10^k
+// is an integer below 2^53 for some small k, the decimal is that integer
+// scaled back, and the division that ParseDouble() would do to undo the
+// scaling verifies it; the other doubles are left to snprintf().
+inline char* FormatDouble(double value, char* buffer) {
+#ifdef HAVE_DOUBLE_PRECISION_ARITHMETIC
+  const bool negative = value < 0 || (value == 0 && 1 / value < 0);
+  const double magnitude = negative ? -value : value;
+  if (magnitude == 0) return FormatDecimal(negative, 0, 0, buffer);
+  for (int scale = 0; scale < static_cast<int>(arraysize(kExactPowersOfTen));
+       ++scale) {
+    const double scaled = magnitude * kExactPowersOfTen[scale];
+    if (!(scaled < static_cast<double>(kMaxExactMantissa)))
+      break;                              // also catches inf and nan
+    uint64 mantissa = static_cast<uint64>(scaled);
+    if (scaled - static_cast<double>(mantissa) >= 0.5) ++mantissa;
+    if (static_cast<double>(mantissa) / kExactPowersOfTen[scale] == magnitude)
+      return FormatDecimal(negative, mantissa, scale, buffer);
+  }
+#endif
+  return FormatDoubleWithSnprintf(value, buffer);
+}
+
 inline bool SafeGetEnv(const char *varname, std::string &valstr)
 {
 #if defined(_MSC_VER) && _MSC_VER >= 1400
@@ -0,0 +1,1285 @@
+// Micro-benchmarks for the gflags library.
+//
+// These are not unit tests: they only print timings.  Build them by
+// configuring with -DBUILD_BENCHMARKS=ON and run, e.g.,
+//
+//    gflags_benchmark --benchmark_filter=Lookup --benchmark_num_flags=10000
+//
+// Every benchmark runs on a registry which, in addition to the flags of
+// this program, holds --benchmark_num_flags synthetic flags of mixed
+// types, to approximate a large binary.
+
+#include <gflags/gflags.h>
+
+#include "config.h"
+#include "mutex.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef OS_WINDOWS
+#  include <windows.h>
+#else
+#  include <sys/resource.h>
+#  include <sys/stat.h>
+#  include <sys/time.h>
+#  include <time.h>
+#endif
+#if defined(HAVE_PTHREAD) && !defined(NO_THREADS)
+#  include <pthread.h>
+#endif
+#include <algorithm>
+#include <map>
+#include <new>
+#include <string>
+#include <vector>
+
+using std::map;
+using std::string;
+using std::vector;
+using GFLAGS_NAMESPACE::int32;
+using GFLAGS_NAMESPACE::int64;
+using GFLAGS_NAMESPACE::uint32;
+using GFLAGS_NAMESPACE::uint64;
+using GFLAGS_NAMESPACE::FlagRegisterer;
+using namespace MUTEX_NAMESPACE;
+
+DEFINE_string(benchmark_filter, "",
+              "only run the benchmarks whose name contains this substring");
+DEFINE_int32(benchmark_num_flags, 10000,
+             "number of synthetic flags to register before benchmarking");
+DEFINE_double(benchmark_scale, 1.0,
+              "multiplier applied to the iteration count of every benchmark");
+
+
+// --------------------------------------------------------------------
+// Benchmark registration and timing
+// --------------------------------------------------------------------
+
+typedef void (*BenchmarkFn)(int64 iters);
+
+struct BenchmarkInfo {
+  const char* name;
+  BenchmarkFn fn;
+  int64 iters;    // before scaling by --benchmark_scale
+};
+
+static vector<BenchmarkInfo>& Benchmarks() {
+  static vector<BenchmarkInfo> benchmarks;
+  return benchmarks;
+}
+
+struct BenchmarkRegisterer {
+  BenchmarkRegisterer(const char* name, BenchmarkFn fn, int64 iters) {
+    BenchmarkInfo info = { name, fn, iters };
+    Benchmarks().push_back(info);
+  }
+};
+
+// Defines a benchmark which is run with the given number of iterations.
+// The body reports its own timings using BenchmarkTimer.
+#define BENCHMARK(name, num_iters)                                      \
+  static void Benchmark_##name(int64 iters);                            \
+  static BenchmarkRegisterer g_benchmark_##name(#name, &Benchmark_##name, \
+                                                num_iters);             \
+  static void Benchmark_##name(int64 iters)
+
+static double NowSeconds() {
+#ifdef OS_WINDOWS
+  LARGE_INTEGER freq, now;
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&now);
+  return static_cast<double>(now.QuadPart) / freq.QuadPart;
+#else
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+#endif
+}
+
+// Measures the wall time between its construction and Report().
+class BenchmarkTimer {
+ public:
+  explicit BenchmarkTimer(const string& label)
+      : label_(label), start_(NowSeconds()) { }
+
+  // Prints the elapsed time, both in total and per operation.
+  void Report(int64 ops) const {
+    const double secs = NowSeconds() - start_;
+    printf("  %-48s %12.1f ns/op %10.3f ms total\n", label_.c_str(),
+           ops > 0 ? secs * 1e9 / ops : 0.0, secs * 1e3);
+    fflush(stdout);
+  }
+
+ private:
+  const string label_;
+  const double start_;
+};
+
+// Returns the peak resident set size of this process in kilobytes,
+// or 0 if we don't know how to find out.
+static long PeakResidentKilobytes() {
+#if defined(OS_WINDOWS)
+  return 0;
+#else
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#  ifdef __APPLE__
+  return usage.ru_maxrss / 1024;   // reported in bytes
+#  else
+  return usage.ru_maxrss;
+#  endif
+#endif
+}
+
+// --------------------------------------------------------------------
+// Allocation counting
+// --------------------------------------------------------------------
+
+static bool g_count_allocations = false;
+static int64 g_num_allocations = 0;
+
+// Counts the calls to operator new made while it is alive.  There must
+// be no other threads running meanwhile.
+class AllocationCounter {
+ public:
+  AllocationCounter() : start_(g_num_allocations) {
+    g_count_allocations = true;
+  }
+  ~AllocationCounter() { g_count_allocations = false; }
+
+  // Prints the number of allocations so far, per operation.
+  void Report(int64 ops) const {
+    printf("  %-48s %12.2f allocs/op\n", "",
+           ops > 0 ? static_cast<double>(g_num_allocations - start_) / ops
+                   : 0.0);
+    fflush(stdout);
+  }
+
+ private:
+  const int64 start_;
+};
+
+#if __cplusplus >= 201103L
+#  define BENCHMARK_THROW_BAD_ALLOC
+#  define BENCHMARK_NOTHROW noexcept
+#else
+#  define BENCHMARK_THROW_BAD_ALLOC throw(std::bad_alloc)
+#  define BENCHMARK_NOTHROW throw()
+#endif
+
+void* operator new(size_t size) BENCHMARK_THROW_BAD_ALLOC {
+  if (g_count_allocations) ++g_num_allocations;
+  void* const p = malloc(size ? size : 1);
+  if (p == NULL) throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void* p) BENCHMARK_NOTHROW {
+  free(p);
+}
+
+#if __cplusplus >= 201402L
+void operator delete(void* p, size_t) BENCHMARK_NOTHROW {
+  free(p);
+}
+#endif
+
+// Keeps the optimizer from discarding otherwise unused results.
+static volatile size_t g_sink;
+
+// --------------------------------------------------------------------
+// Threads
+// --------------------------------------------------------------------
+
+struct ThreadArg {
+  void (*fn)(void*, int);
+  void* arg;
+  int thread;
+};
+
+#if defined(OS_WINDOWS)
+static DWORD WINAPI ThreadMain(LPVOID arg) {
+  ThreadArg* const thread_arg = static_cast<ThreadArg*>(arg);
+  thread_arg->fn(thread_arg->arg, thread_arg->thread);
+  return 0;
+}
+#elif defined(HAVE_PTHREAD) && !defined(NO_THREADS)
+static void* ThreadMain(void* arg) {
+  ThreadArg* const thread_arg = static_cast<ThreadArg*>(arg);
+  thread_arg->fn(thread_arg->arg, thread_arg->thread);
+  return NULL;
+}
+#endif
+
+// Calls fn(arg, i) on num_threads threads at once, with i from 0 to
+// num_threads - 1, and waits for all of them to finish.  Without thread
+// support, the calls are made one at a time.
+static void RunConcurrently(int num_threads, void (*fn)(void*, int),
+                            void* arg) {
+  vector<ThreadArg> thread_args(num_threads);
+  for (int i = 0; i < num_threads; ++i) {
+    const ThreadArg thread_arg = { fn, arg, i };
+    thread_args[i] = thread_arg;
+  }
+#if defined(OS_WINDOWS)
+  vector<HANDLE> threads(num_threads);
+  for (int i = 0; i < num_threads; ++i)
+    threads[i] = CreateThread(NULL, 0, &ThreadMain, &thread_args[i], 0, NULL);
+  for (int i = 0; i < num_threads; ++i) {
+    WaitForSingleObject(threads[i], INFINITE);
+    CloseHandle(threads[i]);
+  }
+#elif defined(HAVE_PTHREAD) && !defined(NO_THREADS)
+  vector<pthread_t> threads(num_threads);
+  for (int i = 0; i < num_threads; ++i)
+    pthread_create(&threads[i], NULL, &ThreadMain, &thread_args[i]);
+  for (int i = 0; i < num_threads; ++i)
+    pthread_join(threads[i], NULL);
+#else
+  for (int i = 0; i < num_threads; ++i)
+    fn(arg, i);
+#endif
+}
+
+// The results of the threads of RunConcurrently(), one slot per thread.
+// g_sink itself is no place for them: volatile stores from several
+// threads are still a data race.
+static vector<size_t> g_thread_sinks;
+
+// Runs fn like RunConcurrently(), then stores the sum of what the
+// threads stored in g_thread_sinks into g_sink.
+static void RunConcurrentlyIntoSink(int num_threads, void (*fn)(void*, int),
+                                    void* arg) {
+  g_thread_sinks.assign(num_threads, 0);
+  RunConcurrently(num_threads, fn, arg);
+  size_t sum = 0;
+  for (int i = 0; i < num_threads; ++i)
+    sum += g_thread_sinks[i];
+  g_sink = sum;
+}
+
+static const int kThreadCounts[] = { 1, 2, 4, 8 };
+
+// --------------------------------------------------------------------
+// Synthetic flags
+// --------------------------------------------------------------------
+
+template <typename T>
+static void RegisterSyntheticFlag(const char* name, const char* filename,
+                                  const T& value) {
+  // The registry keeps pointers to both values, so we never free them.
+  FlagRegisterer registerer(name, "", filename, new T(value), new T(value));
+}
+
+// Flag names must outlive the registry, so we never free these.
+static vector<const char*> g_synthetic_names;
+
+// Registers synthetic flags until there are at least n of them.
+// Flags cycle through bool, int32, int64, double and string types.
+static void EnsureSyntheticFlags(int n) {
+  for (int i = static_cast<int>(g_synthetic_names.size()); i < n; ++i) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "synthetic_flag_%05d", i);
+    const char* name = strdup(buf);
+    const char* file = (i % 2) ? "synthetic/odd.cc" : "synthetic/even.cc";
+    switch (i % 5) {
+      case 0:  RegisterSyntheticFlag(name, file, false);           break;
+      case 1:  RegisterSyntheticFlag(name, file, int32(1));        break;
+      case 2:  RegisterSyntheticFlag(name, file, int64(2));        break;
+      case 3:  RegisterSyntheticFlag(name, file, 3.5);             break;
+      default: RegisterSyntheticFlag(name, file, string("four"));  break;
+    }
+    g_synthetic_names.push_back(name);
+  }
+}
+
+static const vector<const char*>& SyntheticNames() {
+  EnsureSyntheticFlags(FLAGS_benchmark_num_flags);
+  return g_synthetic_names;
+}
+
+// --------------------------------------------------------------------
+// Flag registration
+// --------------------------------------------------------------------
+
+// Registers --benchmark_num_flags new flags per iteration, which is what
+// the static initializers of a binary with that many flags do.  Since
+// the flags stay registered, the growth of the peak RSS approximates
+// the memory which the registry needs for them.
+BENCHMARK(RegisterFlags, 1) {
+  SyntheticNames();   // fault in the flags all other benchmarks use
+  static int registrations = 0;
+  const int n = FLAGS_benchmark_num_flags;
+  for (int64 i = 0; i < iters; ++i) {
+    vector<const char*> names(n);
+    for (int j = 0; j < n; ++j) {
+      char buf[64];
+      snprintf(buf, sizeof(buf), "registered_flag_%d_%05d", registrations, j);
+      names[j] = strdup(buf);
+    }
+    ++registrations;
+    const long rss_before = PeakResidentKilobytes();
+    BenchmarkTimer timer("FlagRegisterer");
+    for (int j = 0; j < n; ++j)
+      RegisterSyntheticFlag(names[j], "synthetic/registered.cc", int32(j));
+    timer.Report(n);
+    printf("  %-48s %12ld KB\n", "peak RSS growth",
+           PeakResidentKilobytes() - rss_before);
+  }
+}
+
+// --------------------------------------------------------------------
+// Flag lookup by name
+// --------------------------------------------------------------------
+
+// This is how the registry used to index flags by name.
+struct StringCmp {
+  bool operator() (const char* s1, const char* s2) const {
+    return (strcmp(s1, s2) < 0);
+  }
+};
+
+BENCHMARK(LookupByName, 2000000) {
+  const vector<const char*>& names = SyntheticNames();
+  const size_t n = names.size();
+
+  map<const char*, size_t, StringCmp> tree;
+  for (size_t i = 0; i < n; ++i)
+    tree[names[i]] = i;
+  {
+    BenchmarkTimer timer("std::map<const char*> (previous index)");
+    size_t found = 0;
+    for (int64 i = 0; i < iters; ++i)
+      found += tree.count(names[(i * 7919) % n]);
+    g_sink = found;
+    timer.Report(iters);
+  }
+
+  {
+    BenchmarkTimer timer("GetCommandLineOption");
+    string value;
+    size_t found = 0;
+    for (int64 i = 0; i < iters; ++i)
+      found += GFLAGS_NAMESPACE::GetCommandLineOption(
+          names[(i * 7919) % n], &value);
+    g_sink = found;
+    timer.Report(iters);
+  }
+
+  {
+    BenchmarkTimer timer("GetCommandLineOption (unknown flag)");
+    string value;
+    size_t found = 0;
+    for (int64 i = 0; i < iters; ++i)
+      found += GFLAGS_NAMESPACE::GetCommandLineOption("no_such_flag", &value);
+    g_sink = found;
+    timer.Report(iters);
+  }
+}
+
+BENCHMARK(ReadFlagsFromString, 20) {
+  const vector<const char*>& names = SyntheticNames();
+  string contents;
+  for (size_t i = 0; i < names.size(); ++i) {
+    contents += "--";
+    contents += names[i];
+    contents += "=1\n";   // a valid value for all of our types
+  }
+  {
+    BenchmarkTimer timer("ReadFlagsFromString");
+    for (int64 i = 0; i < iters; ++i)
+      GFLAGS_NAMESPACE::ReadFlagsFromString(contents, NULL, true);
+    timer.Report(iters);
+  }
+  {
+    // What a small flagfile costs with as many flags registered.
+    const string one_flag = string("--") + names[0] + "=1\n";
+    BenchmarkTimer timer("ReadFlagsFromString (one flag)");
+    for (int64 i = 0; i < iters; ++i)
+      GFLAGS_NAMESPACE::ReadFlagsFromString(one_flag, NULL, true);
+    timer.Report(iters);
+  }
+}
+
+// Sets 1000 flags from FLAGS_<name> variables in the environment, by
+// name and with "*".  The first line is the getenv() per flag that
+// --fromenv used to do, without setting the flags.
+BENCHMARK(ReadFlagsFromEnvironment, 20) {
+  const vector<const char*>& names = SyntheticNames();
+  const size_t kNumFlags = std::min<size_t>(1000, names.size());
+  string flagnames;
+  for (size_t i = 0; i < kNumFlags; ++i) {
+    setenv((string("FLAGS_") + names[i]).c_str(), "1", 1);  // valid for all
+    if (i > 0) flagnames += ",";
+    flagnames += names[i];
+  }
+  {
+    BenchmarkTimer timer("getenv() per flag (previous loop, per flag)");
+    size_t found = 0;
+    for (int64 i = 0; i < iters; ++i) {
+      for (size_t j = 0; j < kNumFlags; ++j)
+        found += getenv((string("FLAGS_") + names[j]).c_str()) != NULL;
+    }
+    g_sink = found;
+    timer.Report(iters * static_cast<int64>(kNumFlags));
+  }
+  const string args[] = { "--tryfromenv=" + flagnames, "--tryfromenv=*" };
+  for (size_t a = 0; a < arraysize(args); ++a) {
+    string program("gflags_benchmark");
+    string arg(args[a]);
+    BenchmarkTimer timer(a == 0 ? "--tryfromenv=<1000 names> (per flag)"
+                                : "--tryfromenv=* (per flag)");
+    for (int64 i = 0; i < iters; ++i) {
+      char* argv[] = { &program[0], &arg[0], NULL };
+      int argc = 2;
+      char** argv_ptr = argv;
+      GFLAGS_NAMESPACE::ParseCommandLineNonHelpFlags(&argc, &argv_ptr, false);
+    }
+    timer.Report(iters * static_cast<int64>(kNumFlags));
+  }
+}
+
+// Parses a command line which sets each synthetic flag once, in the
+// three ways of naming a flag: --flag=value, --noflag (or --flag) for
+// booleans, and --flag-name with dashes.
+BENCHMARK(ParseCommandLine, 20) {
+  const vector<const char*>& names = SyntheticNames();
+  vector<string> args(1, "gflags_benchmark");
+  for (size_t i = 0; i < names.size(); ++i) {
+    string name(names[i]);
+    if (i % 3 == 2)
+      std::replace(name.begin(), name.end(), '_', '-');
+    if (i % 5 == 0)         // a bool
+      args.push_back((i % 2 ? "--no" : "--") + name);
+    else
+      args.push_back("--" + name + "=1");
+  }
+  vector<char*> argv(args.size());
+  AllocationCounter allocations;
+  BenchmarkTimer timer("ParseCommandLineNonHelpFlags (per argument)");
+  for (int64 i = 0; i < iters; ++i) {
+    for (size_t j = 0; j < args.size(); ++j)
+      argv[j] = &args[j][0];
+    int argc = static_cast<int>(argv.size());
+    char** argv_ptr = &argv[0];
+    GFLAGS_NAMESPACE::ParseCommandLineNonHelpFlags(&argc, &argv_ptr, false);
+  }
+  const int64 num_args = iters * static_cast<int64>(names.size());
+  timer.Report(num_args);
+  allocations.Report(num_args);
+}
+
+// Stands in for a validator that does real work, e.g. looks at a file.
+static bool ExpensiveValidator(const char*, int32 value) {
+  volatile int32 sum = 0;
+  for (int i = 0; i < 1000; ++i)
+    sum += value;
+  return true;
+}
+
+// Wrapper scripts and layered flagfiles set the same flags over and over.
+// Here 100 flags are set 100 times each, and the int32 ones among them
+// have an expensive validator.
+BENCHMARK(ParseRepeatedFlags, 20) {
+  const vector<const char*>& names = SyntheticNames();
+  const size_t kNumFlags = std::min<size_t>(100, names.size());
+  for (size_t f = 1; f < kNumFlags; f += 5) {
+    GFLAGS_NAMESPACE::RegisterFlagValidator(
+        static_cast<const int32*>(
+            GFLAGS_NAMESPACE::GetCommandLineFlagInfoOrDie(names[f]).flag_ptr),
+        &ExpensiveValidator);
+  }
+  vector<string> args(1, "gflags_benchmark");
+  for (size_t i = 0; i < 100 * kNumFlags; ++i) {
+    const size_t f = i % kNumFlags;
+    char value[32];
+    snprintf(value, sizeof(value), f % 5 == 3 ? "=%d.25" : "=%d",
+             static_cast<int>(i / kNumFlags));
+    // Bools and strings accept the value as is.
+    args.push_back(string("--") + names[f] + (f % 5 == 0 ? "" : value));
+  }
+  vector<char*> argv(args.size());
+  for (int deduplicate = 0; deduplicate <= 1; ++deduplicate) {
+    GFLAGS_NAMESPACE::SetFlagAssignmentDeduplication(deduplicate != 0);
+    const uint64 num_skipped = GFLAGS_NAMESPACE::GetNumSkippedFlagAssignments();
+    AllocationCounter allocations;
+    BenchmarkTimer timer(deduplicate ? "deduplicated (per argument)"
+                                     : "one by one (per argument)");
+    for (int64 i = 0; i < iters; ++i) {
+      for (size_t j = 0; j < args.size(); ++j)
+        argv[j] = &args[j][0];
+      int argc = static_cast<int>(argv.size());
+      char** argv_ptr = &argv[0];
+      GFLAGS_NAMESPACE::ParseCommandLineNonHelpFlags(&argc, &argv_ptr, false);
+    }
+    const int64 num_args = iters * static_cast<int64>(args.size() - 1);
+    timer.Report(num_args);
+    allocations.Report(num_args);
+    printf("  %-48s %12.2f skipped/op\n", "",
+           static_cast<double>(GFLAGS_NAMESPACE::GetNumSkippedFlagAssignments()
+                               - num_skipped) / num_args);
+  }
+  GFLAGS_NAMESPACE::SetFlagAssignmentDeduplication(false);
+  for (size_t f = 1; f < kNumFlags; f += 5) {
+    GFLAGS_NAMESPACE::RegisterFlagValidator(
+        static_cast<const int32*>(
+            GFLAGS_NAMESPACE::GetCommandLineFlagInfoOrDie(names[f]).flag_ptr),
+        NULL);
+  }
+}
+
+static bool AcceptAnyInt32(const char*, int32) {
+  return true;
+}
+
+// Once all arguments are parsed, the flags still at their default value
+// are validated.  With no arguments at all, that is nearly all a parse
+// does.  Here 10 of the synthetic flags have a validator.
+BENCHMARK(ValidateUnmodifiedFlags, 2000) {
+  const vector<const char*>& names = SyntheticNames();
+  const size_t kNumValidated = 10;
+  const size_t stride = names.size() / (5 * kNumValidated);
+  for (size_t j = 0; j < kNumValidated; ++j) {
+    GFLAGS_NAMESPACE::RegisterFlagValidator(   // an int32 flag
+        static_cast<const int32*>(GFLAGS_NAMESPACE::GetCommandLineFlagInfoOrDie(
+            names[1 + 5 * j * stride]).flag_ptr),
+        &AcceptAnyInt32);
+  }
+  char program[] = "gflags_benchmark";
+  BenchmarkTimer timer("ParseCommandLineNonHelpFlags (no arguments)");
+  for (int64 i = 0; i < iters; ++i) {
+    char* argv[] = { program, NULL };
+    int argc = 1;
+    char** argv_ptr = argv;
+    GFLAGS_NAMESPACE::ParseCommandLineNonHelpFlags(&argc, &argv_ptr, false);
+  }
+  timer.Report(iters);
+  for (size_t j = 0; j < kNumValidated; ++j) {
+    GFLAGS_NAMESPACE::RegisterFlagValidator(
+        static_cast<const int32*>(GFLAGS_NAMESPACE::GetCommandLineFlagInfoOrDie(
+            names[1 + 5 * j * stride]).flag_ptr),
+        NULL);
+  }
+}
+
+// Stands in for a validator that waits for something, e.g. a file on a
+// network file system.
+static bool SlowValidator(const char*, int32) {
+#ifdef OS_WINDOWS
+  Sleep(1);
+#else
+  const struct timespec one_millisecond = { 0, 1000000 };
+  nanosleep(&one_millisecond, NULL);
+#endif
+  return true;
+}
+
+// Parses an empty command line while 32 flags that keep their default
+// value have a validator which takes a millisecond, with the validators
+// run one after the other and several at a time.
+BENCHMARK(ParallelValidation, 10) {
+  const vector<const char*>& names = SyntheticNames();
+  const size_t kNumValidated = 32;
+  const size_t stride = std::max<size_t>(names.size() / (5 * kNumValidated), 1);
+  vector<const int32*> flag_ptrs;
+  for (size_t j = 0; j < kNumValidated && 1 + 5 * j * stride < names.size();
+       ++j) {
+    flag_ptrs.push_back(static_cast<const int32*>(   // an int32 flag
+        GFLAGS_NAMESPACE::GetCommandLineFlagInfoOrDie(
+            names[1 + 5 * j * stride]).flag_ptr));
+    GFLAGS_NAMESPACE::RegisterFlagValidator(flag_ptrs.back(), &SlowValidator);
+  }
+  char program[] = "gflags_benchmark";
+  for (int parallel = 0; parallel <= 1; ++parallel) {
+    GFLAGS_NAMESPACE::SetParallelFlagValidation(parallel != 0);
+    BenchmarkTimer timer(parallel ? "validators in parallel"
+                                  : "validators one by one");
+    for (int64 i = 0; i < iters; ++i) {
+      char* argv[] = { program, NULL };
+      int argc = 1;
+      char** argv_ptr = argv;
+      GFLAGS_NAMESPACE::ParseCommandLineNonHelpFlags(&argc, &argv_ptr, false);
+    }
+    timer.Report(iters);
+  }
+  GFLAGS_NAMESPACE::SetParallelFlagValidation(false);
+  for (size_t j = 0; j < flag_ptrs.size(); ++j)
+    GFLAGS_NAMESPACE::RegisterFlagValidator(flag_ptrs[j], NULL);
+}
+
+// Batch jobs pass thousands of input files, which the parser moves
+// behind the flags.  Each of these argument lists is 100k long.
+BENCHMARK(ParseManyNonOptions, 1) {
+  static const int kNonOptionsPerFlag[] = { 1, 9, 99 };
+  const int kNumArgs = 100000;
+  const string flag = string("--") + SyntheticNames()[1] + "=1";  // an int32
+  for (size_t r = 0; r < arraysize(kNonOptionsPerFlag); ++r) {
+    vector<string> args(1, "gflags_benchmark");
+    for (int i = 0; i < kNumArgs; ++i) {
+      char input[32];
+      snprintf(input, sizeof(input), "input_%06d.txt", i);
+      args.push_back(i % (kNonOptionsPerFlag[r] + 1) == 0 ? flag : input);
+    }
+    vector<char*> argv(args.size());
+    char label[64];
+    snprintf(label, sizeof(label), "%d non-options per flag (per argument)",
+             kNonOptionsPerFlag[r]);
+    BenchmarkTimer timer(label);
+    for (int64 i = 0; i < iters; ++i) {
+      for (size_t j = 0; j < args.size(); ++j)
+        argv[j] = &args[j][0];
+      int argc = static_cast<int>(argv.size());
+      char** argv_ptr = &argv[0];
+      GFLAGS_NAMESPACE::ParseCommandLineNonHelpFlags(&argc, &argv_ptr, true);
+    }
+    timer.Report(iters * kNumArgs);
+  }
+}
+
+// Sets flags of each type at runtime.  Part of the allocations here are
+// for the description of the new value that SetCommandLineOption()
+// returns.
+BENCHMARK(SetCommandLineOption, 200000) {
+  const vector<const char*>& names = SyntheticNames();
+  static const char* const kValues[] = {
+    "true", "12345", "1234567890123", "2.5", "a value too long to fit in "
+    "the small-string buffer of std::string",
+  };
+  for (size_t t = 0; t < arraysize(kValues); ++t) {
+    const char* const name = names[t];   // flag t has the type of kValues[t]
+    char label[64];
+    snprintf(label, sizeof(label), "SetCommandLineOption, %s flag",
+             t == 0 ? "bool" : t == 1 ? "int32" : t == 2 ? "int64" :
+             t == 3 ? "double" : "string");
+    AllocationCounter allocations;
+    BenchmarkTimer timer(label);
+    size_t set = 0;
+    for (int64 i = 0; i < iters; ++i)
+      set += GFLAGS_NAMESPACE::SetCommandLineOption(name, kValues[t]).size();
+    g_sink = set;
+    timer.Report(iters);
+    allocations.Report(iters);
+  }
+}
+
+// Gets and sets an int32 flag by name and through a FlagHandle, as a
+// status page or an RPC which changes flags would.
+BENCHMARK(FlagHandle, 1000000) {
+  const char* const name = SyntheticNames()[1];   // an int32 flag
+  GFLAGS_NAMESPACE::FlagHandle handle(name);
+  {
+    BenchmarkTimer timer("GetCommandLineOption");
+    string value;
+    size_t found = 0;
+    for (int64 i = 0; i < iters; ++i)
+      found += GFLAGS_NAMESPACE::GetCommandLineOption(name, &value);
+    g_sink = found;
+    timer.Report(iters);
+  }
+  {
+    BenchmarkTimer timer("FlagHandle::GetAsString");
+    string value;
+    size_t found = 0;
+    for (int64 i = 0; i < iters; ++i)
+      found += handle.GetAsString(&value);
+    g_sink = found;
+    timer.Report(iters);
+  }
+  {
+    BenchmarkTimer timer("FlagHandle::Get<int32>");
+    GFLAGS_NAMESPACE::int32 value = 0;
+    size_t sum = 0;
+    for (int64 i = 0; i < iters; ++i) {
+      handle.Get(&value);
+      sum += value;
+    }
+    g_sink = sum;
+    timer.Report(iters);
+  }
+  {
+    BenchmarkTimer timer("SetCommandLineOption");
+    size_t set = 0;
+    for (int64 i = 0; i < iters; ++i)
+      set += GFLAGS_NAMESPACE::SetCommandLineOption(name, "12345").size();
+    g_sink = set;
+    timer.Report(iters);
+  }
+  {
+    BenchmarkTimer timer("FlagHandle::Set<int32>");
+    size_t set = 0;
+    for (int64 i = 0; i < iters; ++i)
+      set += handle.Set(static_cast<GFLAGS_NAMESPACE::int32>(i));
+    g_sink = set;
+    timer.Report(iters);
+  }
+}
+
+// A config push which changes 50 or 500 flags, one flag at a time and
+// all together.
+BENCHMARK(SetCommandLineOptions, 2000) {
+  const vector<const char*>& names = SyntheticNames();
+  static const size_t kBatchSizes[] = { 50, 500 };
+  for (size_t b = 0; b < arraysize(kBatchSizes); ++b) {
+    const size_t n = std::min(kBatchSizes[b], names.size());
+    vector<GFLAGS_NAMESPACE::CommandLineOptionUpdate> updates(n);
+    for (size_t j = 0; j < n; ++j) {
+      updates[j].name = names[j];
+      updates[j].value = "1";   // a valid value for all of our types
+      updates[j].set_mode = GFLAGS_NAMESPACE::SET_FLAGS_VALUE;
+    }
+    const int64 batch_iters = std::max<int64>(iters * 50 / n, 1);
+    char label[64];
+    {
+      snprintf(label, sizeof(label),
+               "SetCommandLineOption, %d flags (per flag)",
+               static_cast<int>(n));
+      AllocationCounter allocations;
+      BenchmarkTimer timer(label);
+      size_t set = 0;
+      for (int64 i = 0; i < batch_iters; ++i) {
+        for (size_t j = 0; j < n; ++j)
+          set += GFLAGS_NAMESPACE::SetCommandLineOption(
+              updates[j].name.c_str(), updates[j].value.c_str()).size();
+      }
+      g_sink = set;
+      timer.Report(batch_iters * static_cast<int64>(n));
+      allocations.Report(batch_iters * static_cast<int64>(n));
+    }
+    {
+      snprintf(label, sizeof(label),
+               "SetCommandLineOptions, %d flags (per flag)",
+               static_cast<int>(n));
+      AllocationCounter allocations;
+      BenchmarkTimer timer(label);
+      size_t set = 0;
+      for (int64 i = 0; i < batch_iters; ++i)
+        set += GFLAGS_NAMESPACE::SetCommandLineOptions(&updates);
+      g_sink = set;
+      timer.Report(batch_iters * static_cast<int64>(n));
+      allocations.Report(batch_iters * static_cast<int64>(n));
+    }
+  }
+}
+
+// --------------------------------------------------------------------
+// Number parsing
+// --------------------------------------------------------------------
+
+enum NumberType { kInt32, kUint32, kInt64, kUint64, kDouble };
+
+// Parses value like FlagValue::ParseFrom() used to, with the strtoXXX()
+// routines of the C library, and stores the bits of the result in *bits.
+static bool ParseNumberWithLibc(NumberType type, const char* value,
+                                uint64* bits) {
+  const int base =
+      (value[0] == '0' && (value[1] == 'x' || value[1] == 'X')) ? 16 : 10;
+  char* end;
+  bool in_range = true;
+  errno = 0;
+  if (type == kInt32 || type == kInt64) {
+    const int64 r = strto64(value, &end, base);
+    in_range = (type == kInt64 || static_cast<int32>(r) == r);
+    *bits = static_cast<uint64>(r);
+  } else if (type == kUint32 || type == kUint64) {
+    const uint64 r = strtou64(value, &end, base);
+    in_range = (type == kUint64 || static_cast<uint32>(r) == r);
+    *bits = r;
+  } else {
+    const double r = strtod(value, &end);
+    memcpy(bits, &r, sizeof(r));
+  }
+  return errno == 0 && *end == '\0' && in_range;
+}
+
+// Parses value with the routines FlagValue::ParseFrom() uses now.
+static bool ParseNumberWithGflags(NumberType type, const char* value,
+                                  uint64* bits) {
+  if (type == kInt32 || type == kInt64) {
+    int64 r;
+    if (!GFLAGS_NAMESPACE::ParseInt64(value, &r)) return false;
+    *bits = static_cast<uint64>(r);
+    return type == kInt64 || static_cast<int32>(r) == r;
+  } else if (type == kUint32 || type == kUint64) {
+    if (!GFLAGS_NAMESPACE::ParseUint64(value, bits)) return false;
+    return type == kUint64 || static_cast<uint32>(*bits) == *bits;
+  } else {
+    double r;
+    if (!GFLAGS_NAMESPACE::ParseDouble(value, &r)) return false;
+    memcpy(bits, &r, sizeof(r));
+    return true;
+  }
+}
+
+BENCHMARK(ParseNumbers, 1000000) {
+  static const struct {
+    NumberType type;
+    const char* name;
+    const char* values[4];
+  } kCases[] = {
+    { kInt32,  "int32",  { "12345", "-42", "0x7fffffff", "2000000000" } },
+    { kUint32, "uint32", { "7", "4000000000", "0xdeadbeef", "65536" } },
+    { kInt64,  "int64",  { "0", "1234567890123", "-9000000000000000000",
+                           "0x123456789abc" } },
+    { kUint64, "uint64", { "99", "18446744073709551615", "1234567890123",
+                           "0xffffffffffff" } },
+    { kDouble, "double", { "2.5", "0.001", "3.14159265358979", "-1e10" } },
+  };
+  typedef bool (*ParseFn)(NumberType, const char*, uint64*);
+  static const ParseFn kParsers[] = {
+    &ParseNumberWithLibc, &ParseNumberWithGflags
+  };
+  for (size_t c = 0; c < arraysize(kCases); ++c) {
+    for (size_t p = 0; p < arraysize(kParsers); ++p) {
+      char label[64];
+      snprintf(label, sizeof(label), "%s, %s", kCases[c].name,
+               p == 0 ? "strtoXXX()" : "gflags");
+      BenchmarkTimer timer(label);
+      uint64 sum = 0;
+      for (int64 i = 0; i < iters; ++i) {
+        for (size_t v = 0; v < arraysize(kCases[c].values); ++v) {
+          uint64 bits = 0;
+          if (kParsers[p](kCases[c].type, kCases[c].values[v], &bits))
+            sum += bits;
+        }
+      }
+      g_sink = static_cast<size_t>(sum);
+      timer.Report(iters * arraysize(kCases[c].values));
+    }
+  }
+}
+
+// Formats the bits of a number like FlagValue::ToString() used to, with
+// snprintf(), and returns the length of the result.
+static size_t FormatNumberWithLibc(NumberType type, uint64 bits,
+                                   char* buffer) {
+  double d;
+  switch (type) {
+    case kInt32:  return snprintf(buffer, 64, "%" PRId32,
+                                  static_cast<int32>(bits));
+    case kUint32: return snprintf(buffer, 64, "%" PRIu32,
+                                  static_cast<uint32>(bits));
+    case kInt64:  return snprintf(buffer, 64, "%" PRId64,
+                                  static_cast<int64>(bits));
+    case kUint64: return snprintf(buffer, 64, "%" PRIu64, bits);
+    default:
+      memcpy(&d, &bits, sizeof(d));
+      return snprintf(buffer, 64, "%.17g", d);
+  }
+}
+
+// Formats the bits of a number with the routines FlagValue uses now.
+static size_t FormatNumberWithGflags(NumberType type, uint64 bits,
+                                     char* buffer) {
+  double d;
+  switch (type) {
+    case kInt32:
+      return GFLAGS_NAMESPACE::FormatInt64(static_cast<int32>(bits), buffer) -
+             buffer;
+    case kUint32:
+      return GFLAGS_NAMESPACE::FormatUint64(static_cast<uint32>(bits),
+                                            buffer) - buffer;
+    case kInt64:
+      return GFLAGS_NAMESPACE::FormatInt64(static_cast<int64>(bits), buffer) -
+             buffer;
+    case kUint64:
+      return GFLAGS_NAMESPACE::FormatUint64(bits, buffer) - buffer;
+    default:
+      memcpy(&d, &bits, sizeof(d));
+      return GFLAGS_NAMESPACE::FormatDouble(d, buffer) - buffer;
+  }
+}
+
+BENCHMARK(FormatNumbers, 1000000) {
+  static const struct {
+    NumberType type;
+    const char* name;
+    const char* values[4];
+  } kCases[] = {
+    { kInt32,  "int32",  { "12345", "-42", "2147483647", "0" } },
+    { kUint32, "uint32", { "7", "4000000000", "65536", "100" } },
+    { kInt64,  "int64",  { "1234567890123", "-9000000000000000000", "-2",
+                           "42" } },
+    { kUint64, "uint64", { "18446744073709551615", "99", "1234567890123",
+                           "281474976710655" } },
+    { kDouble, "double", { "2.5", "0.001", "3.14159265358979", "-1e10" } },
+    { kDouble, "double, long or extreme", { "0.30000000000000004",
+                                            "0.3333333333333333", "1e-300",
+                                            "1.7976931348623157e308" } },
+  };
+  typedef size_t (*FormatFn)(NumberType, uint64, char*);
+  static const FormatFn kFormatters[] = {
+    &FormatNumberWithLibc, &FormatNumberWithGflags
+  };
+  for (size_t c = 0; c < arraysize(kCases); ++c) {
+    uint64 bits[arraysize(kCases[c].values)];
+    for (size_t v = 0; v < arraysize(bits); ++v)
+      ParseNumberWithGflags(kCases[c].type, kCases[c].values[v], &bits[v]);
+    for (size_t f = 0; f < arraysize(kFormatters); ++f) {
+      char label[64];
+      snprintf(label, sizeof(label), "%s, %s", kCases[c].name,
+               f == 0 ? "snprintf()" : "gflags");
+      BenchmarkTimer timer(label);
+      char buffer[64];
+      size_t length = 0;
+      for (int64 i = 0; i < iters; ++i) {
+        for (size_t v = 0; v < arraysize(bits); ++v)
+          length += kFormatters[f](kCases[c].type, bits[v], buffer);
+      }
+      g_sink = length;
+      timer.Report(iters * arraysize(bits));
+    }
+  }
+}
+
+// --------------------------------------------------------------------
+// Flagfile parsing
+// --------------------------------------------------------------------
+
+// Returns flagfile contents of about the given size which set the
+// synthetic flags over and over again, with a comment now and then.
+static string MakeFlagfileContents(size_t size) {
+  const vector<const char*>& names = SyntheticNames();
+  string contents;
+  contents.reserve(size + 64);
+  for (size_t i = 0; contents.size() < size; ++i) {
+    if (i % 100 == 0)
+      contents += "# set some more flags\n";
+    contents += "--";
+    contents += names[i % names.size()];
+    contents += "=1\n";
+  }
+  return contents;
+}
+
+// Sizes are scaled by --benchmark_scale, like the iteration counts.
+BENCHMARK(ParseFlagfile, 1) {
+  static const int kMegabytes[] = { 1, 10, 100 };
+  for (size_t m = 0; m < arraysize(kMegabytes); ++m) {
+    const size_t size = static_cast<size_t>(
+        kMegabytes[m] * 1048576.0 * FLAGS_benchmark_scale);
+    const string contents = MakeFlagfileContents(size);
+    char label[64];
+    snprintf(label, sizeof(label), "ReadFlagsFromBuffer, %d MB (per byte)",
+             kMegabytes[m]);
+    const int64 lines = std::count(contents.begin(), contents.end(), '\n');
+    AllocationCounter allocations;
+    BenchmarkTimer timer(label);
+    for (int64 i = 0; i < iters; ++i)
+      GFLAGS_NAMESPACE::ReadFlagsFromBuffer(contents.data(), contents.size(),
+                                            true);
+    timer.Report(iters * static_cast<int64>(contents.size()));
+    allocations.Report(iters * lines);   // per line
+  }
+}
+
+// A flagfile shared by 1000 programs, with a section for each, of which
+// only the last applies to us.  Each section header names a program in
+// three ways.
+BENCHMARK(ParseFlagfileSections, 100) {
+  const vector<const char*>& names = SyntheticNames();
+  const int kNumSections = 1000;
+  string contents;
+  for (int i = 0; i < kNumSections; ++i) {
+    char header[128];
+    if (i + 1 < kNumSections)
+      snprintf(header, sizeof(header),
+               "server_%04d /usr/bin/server_%04d *_%04d_test\n", i, i, i);
+    else
+      snprintf(header, sizeof(header), "*gflags_benchmark*\n");
+    contents += header;
+    contents += "--";
+    contents += names[i % names.size()];
+    contents += "=1\n";
+  }
+  BenchmarkTimer timer("ReadFlagsFromBuffer (per section)");
+  for (int64 i = 0; i < iters; ++i)
+    GFLAGS_NAMESPACE::ReadFlagsFromBuffer(contents.data(), contents.size(),
+                                          true);
+  timer.Report(iters * kNumSections);
+}
+
+// Returns the name of a scratch file in $TMPDIR.
+static string TempFileName(const char* basename) {
+  const char* dir = getenv("TMPDIR");
+#ifdef OS_WINDOWS
+  if (dir == NULL || *dir == '\0') dir = getenv("TEMP");
+  if (dir == NULL || *dir == '\0') dir = ".";
+  return string(dir) + "\\" + basename;
+#else
+  if (dir == NULL || *dir == '\0') dir = "/tmp";
+  return string(dir) + "/" + basename;
+#endif
+}
+
+// Like ParseFlagfile, but reads the flags from an actual file.  We write
+// the file a chunk at a time, so that the peak RSS reflects the memory
+// needed to read it, rather than the memory needed to generate it.
+// Where we can, we also read the file once more after making it
+// read-only, which is when gflags maps it into memory instead.
+BENCHMARK(ReadFromFlagsFile, 1) {
+  static const int kMegabytes[] = { 1, 10, 100 };
+  const string filename = TempFileName("gflags_benchmark.flags");
+  for (size_t m = 0; m < arraysize(kMegabytes); ++m) {
+    const size_t size = static_cast<size_t>(
+        kMegabytes[m] * 1048576.0 * FLAGS_benchmark_scale);
+    size_t written = 0;
+    {
+      FILE* fp = fopen(filename.c_str(), "w");
+      if (fp == NULL) {
+        perror(filename.c_str());
+        return;
+      }
+      const string chunk = MakeFlagfileContents(size < 1048576 ? size : 1048576);
+      for (; written < size; written += chunk.size())
+        fwrite(chunk.data(), 1, chunk.size(), fp);
+      fclose(fp);
+    }
+#ifdef OS_WINDOWS
+    static const int kNumModes = 1;
+#else
+    static const int kNumModes = 2;
+#endif
+    for (int read_only = 0; read_only < kNumModes; ++read_only) {
+#ifndef OS_WINDOWS
+      chmod(filename.c_str(), read_only ? 0444 : 0644);
+#endif
+      char label[64];
+      snprintf(label, sizeof(label), "ReadFromFlagsFile, %d MB%s (per byte)",
+               kMegabytes[m], read_only ? ", read-only" : "");
+      const long rss_before = PeakResidentKilobytes();
+      BenchmarkTimer timer(label);
+      for (int64 i = 0; i < iters; ++i)
+        GFLAGS_NAMESPACE::ReadFromFlagsFile(filename, NULL, true);
+      timer.Report(iters * static_cast<int64>(written));
+      printf("  %-48s %12ld KB\n", "peak RSS growth",
+             PeakResidentKilobytes() - rss_before);
+    }
+#ifndef OS_WINDOWS
+    chmod(filename.c_str(), 0644);   // so that we can write it again
+#endif
+  }
+  remove(filename.c_str());
+}
+
+// Compares loading a text flagfile with loading the binary flagfile
+// compiled from it.
+BENCHMARK(ReadBinaryFlagfile, 1) {
+  static const int kMegabytes[] = { 1, 10 };
+  const string text = TempFileName("gflags_benchmark.flags");
+  const string binary = TempFileName("gflags_benchmark.flags.bin");
+  for (size_t m = 0; m < arraysize(kMegabytes); ++m) {
+    const string contents = MakeFlagfileContents(static_cast<size_t>(
+        kMegabytes[m] * 1048576.0 * FLAGS_benchmark_scale));
+    const int64 lines = std::count(contents.begin(), contents.end(), '\n');
+    FILE* fp = fopen(text.c_str(), "w");
+    if (fp == NULL) {
+      perror(text.c_str());
+      return;
+    }
+    fwrite(contents.data(), 1, contents.size(), fp);
+    fclose(fp);
+    if (!GFLAGS_NAMESPACE::CompileFlagfile(text, binary)) {
+      perror(binary.c_str());
+      return;
+    }
+    const string* const filenames[] = { &text, &binary };
+    for (size_t f = 0; f < arraysize(filenames); ++f) {
+      char label[64];
+      snprintf(label, sizeof(label), "%s flagfile, %d MB (per line)",
+               f == 0 ? "text" : "binary", kMegabytes[m]);
+      AllocationCounter allocations;
+      BenchmarkTimer timer(label);
+      for (int64 i = 0; i < iters; ++i)
+        GFLAGS_NAMESPACE::ReadFromFlagsFile(*filenames[f], NULL, true);
+      timer.Report(iters * lines);
+      allocations.Report(iters * lines);
+    }
+  }
+  remove(text.c_str());
+  remove(binary.c_str());
+}
+
+// --------------------------------------------------------------------
+// Iteration over all flags
+// --------------------------------------------------------------------
+
+// Collects the names of the flags which don't have their default value,
+// which is what a status page often shows.
+class ModifiedFlagNames : public GFLAGS_NAMESPACE::CommandLineFlagVisitor {
+ public:
+  virtual void Visit(const GFLAGS_NAMESPACE::CommandLineFlagView& flag) {
+    if (!flag.is_default())
+      names.push_back(flag.name());
+  }
+
+  vector<const char*> names;
+};
+
+BENCHMARK(IterateAllFlags, 50) {
+  const size_t n = SyntheticNames().size();
+  {
+    BenchmarkTimer timer("GetAllFlags");
+    size_t found = 0;
+    for (int64 i = 0; i < iters; ++i) {
+      vector<GFLAGS_NAMESPACE::CommandLineFlagInfo> flags;
+      GFLAGS_NAMESPACE::GetAllFlags(&flags);
+      found += flags.size();
+    }
+    g_sink = found;
+    timer.Report(iters * n);
+  }
+  {
+    BenchmarkTimer timer("VisitAllFlags (names of modified flags)");
+    size_t found = 0;
+    for (int64 i = 0; i < iters; ++i) {
+      ModifiedFlagNames visitor;
+      GFLAGS_NAMESPACE::VisitAllFlags(&visitor);
+      found += visitor.names.size();
+    }
+    g_sink = found;
+    timer.Report(iters * n);
+  }
+  {
+    // Loading a plugin between two listings leaves a flag which the
+    // registry has not merged into its sorted order yet.
+    static int registrations = 0;
+    BenchmarkTimer timer("GetAllFlags (after registering a flag)");
+    size_t found = 0;
+    for (int64 i = 0; i < iters; ++i) {
+      char buf[64];
+      snprintf(buf, sizeof(buf), "late_flag_%05d", registrations++);
+      RegisterSyntheticFlag(strdup(buf), "synthetic/late.cc", int32(0));
+      vector<GFLAGS_NAMESPACE::CommandLineFlagInfo> flags;
+      GFLAGS_NAMESPACE::GetAllFlags(&flags);
+      found += flags.size();
+    }
+    g_sink = found;
+    timer.Report(iters * n);
+  }
+  {
+    BenchmarkTimer timer("FlagSaver save and restore");
+    for (int64 i = 0; i < iters; ++i) {
+      GFLAGS_NAMESPACE::FlagSaver saver;
+    }
+    timer.Report(iters * n);
+  }
+}
+
+// Formats the current value of every flag, which is what --helpxml, a
+// flagfile dump or a status page do.
+BENCHMARK(DumpAllFlags, 50) {
+  const vector<const char*>& names = SyntheticNames();
+  const size_t n = names.size();
+  {
+    BenchmarkTimer timer("CommandlineFlagsIntoString (per flag)");
+    size_t length = 0;
+    for (int64 i = 0; i < iters; ++i)
+      length += GFLAGS_NAMESPACE::CommandlineFlagsIntoString().size();
+    g_sink = length;
+    timer.Report(iters * n);
+  }
+  {
+    AllocationCounter allocations;
+    BenchmarkTimer timer("GetCommandLineOption (per flag)");
+    string dump, value;
+    for (int64 i = 0; i < iters; ++i) {
+      dump.clear();
+      for (size_t f = 0; f < n; ++f) {
+        GFLAGS_NAMESPACE::GetCommandLineOption(names[f], &value);
+        dump += value;
+      }
+    }
+    g_sink = dump.size();
+    timer.Report(iters * n);
+    allocations.Report(iters * n);
+  }
+  {
+    AllocationCounter allocations;
+    BenchmarkTimer timer("AppendCommandLineOption (per flag)");
+    string dump;
+    for (int64 i = 0; i < iters; ++i) {
+      dump.clear();
+      for (size_t f = 0; f < n; ++f)
+        GFLAGS_NAMESPACE::AppendCommandLineOption(names[f], &dump);
+    }
+    g_sink = dump.size();
+    timer.Report(iters * n);
+    allocations.Report(iters * n);
+  }
+}
+
+// --------------------------------------------------------------------
+// Concurrent access to the global registry
+// --------------------------------------------------------------------
+
+static int64 g_concurrent_iters;
+
+// This is how GlobalRegistry() used to check for the singleton.
+static void* MutexGuardedSingleton() {
+  static Mutex lock(Mutex::LINKER_INITIALIZED);
+  static void* singleton = NULL;
+  MutexLock acquire_lock(&lock);
+  if (!singleton) singleton = &g_concurrent_iters;
+  return singleton;
+}
+
+static void LoopMutexGuardedSingleton(void*, int thread) {
+  size_t sum = 0;
+  for (int64 i = 0; i < g_concurrent_iters; ++i)
+    sum += reinterpret_cast<size_t>(MutexGuardedSingleton());
+  g_thread_sinks[thread] = sum;
+}
+
+static void LoopGetCommandLineOption(void* name, int thread) {
+  string value;
+  size_t found = 0;
+  for (int64 i = 0; i < g_concurrent_iters; ++i)
+    found += GFLAGS_NAMESPACE::GetCommandLineOption(
+        static_cast<const char*>(name), &value);
+  g_thread_sinks[thread] = found;
+}
+
+BENCHMARK(ConcurrentGlobalRegistry, 1000000) {
+  const char* name = SyntheticNames()[1];   // an int32 flag
+  g_concurrent_iters = iters;
+  for (size_t t = 0; t < arraysize(kThreadCounts); ++t) {
+    const int threads = kThreadCounts[t];
+    char label[64];
+    snprintf(label, sizeof(label),
+             "mutex-guarded singleton, %d threads", threads);
+    BenchmarkTimer timer(label);
+    RunConcurrentlyIntoSink(threads, &LoopMutexGuardedSingleton, NULL);
+    timer.Report(iters * threads);
+  }
+  for (size_t t = 0; t < arraysize(kThreadCounts); ++t) {
+    const int threads = kThreadCounts[t];
+    char label[64];
+    snprintf(label, sizeof(label), "GetCommandLineOption, %d threads", threads);
+    BenchmarkTimer timer(label);
+    RunConcurrentlyIntoSink(threads, &LoopGetCommandLineOption,
+                            const_cast<char*>(name));
+    timer.Report(iters * threads);
+  }
+}
+
+
+int main(int argc, char** argv) {
+  GFLAGS_NAMESPACE::SetUsageMessage("Runs the gflags micro-benchmarks");
+  GFLAGS_NAMESPACE::ParseCommandLineFlags(&argc, &argv, true);
+  EnsureSyntheticFlags(FLAGS_benchmark_num_flags);
+
+  const vector<BenchmarkInfo>& benchmarks = Benchmarks();
+  for (size_t i = 0; i < benchmarks.size(); ++i) {
+    if (strstr(benchmarks[i].name, FLAGS_benchmark_filter.c_str()) == NULL)
+      continue;
+    int64 iters = static_cast<int64>(benchmarks[i].iters * FLAGS_benchmark_scale);
+    if (iters < 1) iters = 1;
+    printf("%s (%d flags, %lld iterations)\n", benchmarks[i].name,
+           FLAGS_benchmark_num_flags, static_cast<long long>(iters));
+    benchmarks[i].fn(iters);
+  }
+  GFLAGS_NAMESPACE::ShutDownCommandLineFlags();
+  return 0;
+}
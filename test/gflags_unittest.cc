@@ -44,6 +44,9 @@
 #ifdef HAVE_UNISTD_H
 #  include <unistd.h>   // for unlink()
 #endif
+#ifdef HAVE_SYS_STAT_H
+#  include <sys/stat.h> // for chmod()
+#endif
 #include <vector>
 #include <string>
 TEST_INIT
@@ -370,6 +373,36 @@ TEST(FlagFileTest, ReadFlagsFromString) {
       false,
       123,
       123.0);
+
+  // Test that Unix and Windows line endings can be mixed, and that the
+  // last line needs no line ending at all.
+  TestFlagString(
+      // Flag string
+      "-test_string=mixed\n"
+      "-test_bool=true\r\n"
+      "# a comment\n"
+      "-test_int32=456\n"
+      "-test_double=456.0",
+      // Expected values
+      "mixed",
+      true,
+      456,
+      456.0);
+}
+
+// Tests reading flags from a buffer that is not NUL-terminated.
+TEST(FlagFileTest, ReadFlagsFromBuffer) {
+  FLAGS_test_bool = false;
+  const char contents[] =
+      "-test_string=buffer\n"
+      "--notest_bool\n"
+      "-test_int32=789"        // the buffer ends here
+      "0\n-test_bool=true\n";
+  EXPECT_TRUE(ReadFlagsFromBuffer(contents, strstr(contents, "0\n") - contents,
+                                  true));
+  EXPECT_EQ("buffer", FLAGS_test_string);
+  EXPECT_FALSE(FLAGS_test_bool);
+  EXPECT_EQ(789, FLAGS_test_int32);
 }
 
 // Tests the filename part of the flagfile
@@ -477,6 +510,30 @@ TEST(FlagFileTest, FilenamesOurfileInBigList) {
       1,
       -1.0);
 }
+
+// We remember whether each filenames line matches, so make sure that a
+// line we have seen before still gives the same answer.
+TEST(FlagFileTest, FilenamesRepeated) {
+  FLAGS_test_string = "initial";
+  FLAGS_test_bool = false;
+  FLAGS_test_int32 = -1;
+  FLAGS_test_double = -1.0;
+  TestFlagString(
+      // Flag string
+      "not_our_filename\n"
+      "-test_int32=1\n"
+      "*flags*\n"
+      "-test_bool=true\n"
+      "not_our_filename\n"
+      "-test_string=not ours\n"
+      "*flags*\n"
+      "-test_double=1000.0\n",
+      // Expected values
+      "initial",
+      true,
+      -1,
+      1000.0);
+}
 #endif  // defined(HAVE_FNMATCH_H) || defined(HAVE_SHLWAPI_H)
 
 // Tests that a failed flag-from-string read keeps flags at default values
@@ -497,6 +554,66 @@ TEST(FlagFileTest, FailReadFlagsFromString) {
   EXPECT_EQ("initial", FLAGS_test_string);
 }
 
+// Tests that a failed flag-from-string read also leaves the flags it
+// set, even more than once, not modified, and the other flags alone.
+TEST(FlagFileTest, FailReadFlagsFromStringKeepsFlagsUnmodified) {
+  FLAGS_test_bool = true;
+  string flags("-test_int32=1\n"
+               "-test_int32=2\n"
+               "-test_string=non_initial\n"
+               "-test_double=illegal\n");
+
+  EXPECT_FALSE(ReadFlagsFromString(flags,
+                                   GetArgv0(),
+                                   // errors are fatal
+                                   false));
+
+  EXPECT_EQ(-1, FLAGS_test_int32);
+  EXPECT_EQ("initial", FLAGS_test_string);
+  EXPECT_TRUE(FLAGS_test_bool);
+  SetCommandLineOptionWithMode("test_int32", "3", SET_FLAG_IF_DEFAULT);
+  EXPECT_EQ(3, FLAGS_test_int32);
+  SetCommandLineOptionWithMode("test_string", "third", SET_FLAG_IF_DEFAULT);
+  EXPECT_EQ("third", FLAGS_test_string);
+}
+
+// Tests that --tryfromenv=* sets all flags which have a variable in the
+// environment, except for the ones that read more flags.
+TEST(FlagFileTest, ReadAllFlagsFromEnvironment) {
+  setenv("FLAGS_test_int32", "77", 1);
+  setenv("FLAGS_test_string", "from the environment", 1);
+  setenv("FLAGS_flagfile", "/this/file/does/not/exist", 1);
+  setenv("FLAGS_this_flag_does_not_exist", "1", 1);
+  EXPECT_TRUE(ReadFlagsFromString("--tryfromenv=*",
+                                  GetArgv0(),
+                                  // errors are fatal
+                                  true));
+  EXPECT_EQ(77, FLAGS_test_int32);
+  EXPECT_EQ("from the environment", FLAGS_test_string);
+  setenv("FLAGS_flagfile", "", 1);
+}
+
+// Tests that --fromenv reads the variable for a flag name as given, like
+// getenv() would, even if the name has dashes instead of underscores.
+TEST(FlagFileTest, ReadDashedFlagNameFromEnvironment) {
+  setenv("FLAGS_test_int32", "1", 1);
+  setenv("FLAGS_test-int32", "2", 1);
+  EXPECT_TRUE(ReadFlagsFromString("--fromenv=test-int32",
+                                  GetArgv0(),
+                                  // errors are fatal
+                                  true));
+  EXPECT_EQ(2, FLAGS_test_int32);
+  EXPECT_TRUE(ReadFlagsFromString("--fromenv=test_int32",
+                                  GetArgv0(),
+                                  // errors are fatal
+                                  true));
+  EXPECT_EQ(1, FLAGS_test_int32);
+  EXPECT_FALSE(ReadFlagsFromString("--fromenv=test-bool",
+                                   GetArgv0(),
+                                   // errors are not fatal
+                                   false));
+}
+
 // Tests that flags can be set to ordinary values.
 TEST(SetFlagValueTest, OrdinaryValues) {
   EXPECT_EQ("initial", FLAGS_test_str1);
@@ -641,6 +758,82 @@ TEST(SetFlagValueTest, IllegalValues) {
   EXPECT_EQ(119111, FLAGS_test_uint64);
 }
 
+// Tests the limits of the integer types in both radices
+TEST(SetFlagValueTest, IntegerLimits) {
+  EXPECT_EQ("test_int32 set to -2147483648\n",
+            SetCommandLineOption("test_int32", "-2147483648"));
+  EXPECT_EQ("", SetCommandLineOption("test_int32", "2147483648"));
+  EXPECT_EQ("test_uint32 set to 4294967295\n",
+            SetCommandLineOption("test_uint32", "0xffffffff"));
+  EXPECT_EQ("", SetCommandLineOption("test_uint32", "0x100000000"));
+
+  EXPECT_EQ("test_int64 set to 9223372036854775807\n",
+            SetCommandLineOption("test_int64", "9223372036854775807"));
+  EXPECT_EQ("", SetCommandLineOption("test_int64", "9223372036854775808"));
+  EXPECT_EQ("test_int64 set to -9223372036854775808\n",
+            SetCommandLineOption("test_int64", "-9223372036854775808"));
+  EXPECT_EQ("", SetCommandLineOption("test_int64", "-9223372036854775809"));
+  EXPECT_EQ("", SetCommandLineOption("test_int64", "0x8000000000000000"));
+
+  EXPECT_EQ("test_uint64 set to 18446744073709551615\n",
+            SetCommandLineOption("test_uint64", "18446744073709551615"));
+  EXPECT_EQ("", SetCommandLineOption("test_uint64", "18446744073709551616"));
+  EXPECT_EQ("", SetCommandLineOption("test_uint64", "99999999999999999999"));
+  EXPECT_EQ("test_uint64 set to 18446744073709551615\n",
+            SetCommandLineOption("test_uint64", "0x000FFFFFFFFFFFFFFFF"));
+  EXPECT_EQ("", SetCommandLineOption("test_uint64", "0x10000000000000000"));
+  EXPECT_EQ("test_uint64 set to 12\n",
+            SetCommandLineOption("test_uint64", "00000000000000000000012"));
+
+  // Leading white space and signs are accepted, but not with hex numbers
+  EXPECT_EQ("test_int32 set to 12\n",
+            SetCommandLineOption("test_int32", " \t+12"));
+  EXPECT_EQ("test_uint32 set to 12\n",
+            SetCommandLineOption("test_uint32", "  12"));
+  EXPECT_EQ("", SetCommandLineOption("test_int32", " 0x12"));
+  EXPECT_EQ("", SetCommandLineOption("test_uint32", " 0x12"));
+  EXPECT_EQ("", SetCommandLineOption("test_uint64", " 0x12"));
+  EXPECT_EQ("", SetCommandLineOption("test_int32", "-0x12"));
+  EXPECT_EQ("", SetCommandLineOption("test_int32", "0x"));
+  EXPECT_EQ("", SetCommandLineOption("test_int32", "0x-12"));
+  EXPECT_EQ("", SetCommandLineOption("test_int32", "12 "));
+  EXPECT_EQ("", SetCommandLineOption("test_int32", "+"));
+}
+
+// Tests that doubles are converted exactly like strtod() does in the C locale
+TEST(SetFlagValueTest, DoublesMatchStrtod) {
+  const char* const kValues[] = {
+    "0", "-0", "1", "+1.5", " 2.25", "0.1", "-0.3", ".5", "5.", "3.14159",
+    "1e10", "1E-10", "2.5e+3", "1e22", "1e23", "1e-22", "1e-23",
+    "9007199254740993", "9007199254740993e1", "123456789012345678",
+    "1234567890123456789012", "0.000000000000000000000000001",
+    "1.7976931348623157e308", "0x1.8p1", "0X10", "00012.50",
+    "0.30000000000000004", "2.2250738585072014e-308", "9007199254740993e22"
+  };
+  for (size_t i = 0; i < arraysize(kValues); ++i) {
+    double parsed = -1.0;
+    EXPECT_TRUE(ParseDouble(kValues[i], &parsed));
+    const double expected = strtod(kValues[i], NULL);
+    EXPECT_EQ(0, memcmp(&expected, &parsed, sizeof(expected)));
+  }
+  // 2^53 + 1 is the smallest mantissa which is not exact as a double,
+  // so it must not be scaled on the fast path, where it would become
+  // 2^53 * 10 rather than the nearest double to the exact product.
+  double boundary = 0.0;
+  EXPECT_TRUE(ParseDouble("9007199254740993e1", &boundary));
+  EXPECT_EQ(90071992547409936.0, boundary);
+  EXPECT_TRUE(ParseDouble("-9007199254740993e1", &boundary));
+  EXPECT_EQ(-90071992547409936.0, boundary);
+  double unchanged = 42.0;
+  EXPECT_FALSE(ParseDouble("1e", &unchanged));
+  EXPECT_FALSE(ParseDouble("1.5 ", &unchanged));
+  EXPECT_FALSE(ParseDouble(".", &unchanged));
+  EXPECT_FALSE(ParseDouble("-", &unchanged));
+  EXPECT_FALSE(ParseDouble("1e999", &unchanged));
+  EXPECT_FALSE(ParseDouble("1,5", &unchanged));
+  EXPECT_EQ(42.0, unchanged);
+}
+
 
 // Tests that we only evaluate macro args once
 TEST(MacroArgs, EvaluateOnce) {
@@ -896,6 +1089,94 @@ TEST(GetAllFlagsTest, BaseTest) {
   EXPECT_TRUE(found_test_bool);
 }
 
+TEST(GetAllFlagsTest, SortedAfterRegisteringMoreFlags) {
+  // Enough flags that the registry merges some of them into its sorted
+  // index, but not all.  Like in DescriptionIsInvalid below, the
+  // storage must outlive the registry.
+  static char names[100][32];
+  static int32 current_storage[100];
+  static int32 defvalue_storage[100];
+  for (int i = 99; i >= 0; --i) {
+    snprintf(names[i], sizeof(names[i]), "late_flag_%02d", i);
+    FlagRegisterer fr(names[i], NULL, (i % 2) ? "late_odd.cc" : "late.cc",
+                      &current_storage[i], &defvalue_storage[i]);
+  }
+  vector<CommandLineFlagInfo> flags;
+  GetAllFlags(&flags);
+  for (size_t i = 1; i < flags.size(); ++i) {
+    const int cmp = strcmp(flags[i-1].filename.c_str(),
+                           flags[i].filename.c_str());
+    EXPECT_TRUE(cmp < 0 || (cmp == 0 && flags[i-1].name < flags[i].name));
+  }
+  int num_late_flags = 0;
+  for (size_t i = 0; i < flags.size(); ++i) {
+    if (flags[i].name.compare(0, 10, "late_flag_") == 0)
+      ++num_late_flags;
+  }
+  EXPECT_EQ(100, num_late_flags);
+}
+
+// GetAllFlags only takes the registry's reader lock, but must still
+// remember that a flag was assigned directly, as GetCommandLineFlagInfo does.
+TEST(GetAllFlagsTest, DirectAssignmentIsSticky) {
+  FLAGS_test_int64 = 119;
+  vector<CommandLineFlagInfo> flags;
+  GetAllFlags(&flags);
+  FLAGS_test_int64 = -2;    // back to the default value
+  EXPECT_FALSE(GetCommandLineFlagInfoOrDie("test_int64").is_default);
+}
+
+// Copies what it sees of each flag, without using FillCommandLineFlagInfo.
+class FlagCopier : public CommandLineFlagVisitor {
+ public:
+  virtual void Visit(const CommandLineFlagView& flag) {
+    CommandLineFlagInfo info;
+    info.name = flag.name();
+    info.type = flag.type();
+    info.description = flag.description();
+    flag.AppendCurrentValue(&info.current_value);
+    flag.AppendDefaultValue(&info.default_value);
+    info.filename = flag.filename();
+    info.has_validator_fn = flag.has_validator_fn();
+    info.is_default = flag.is_default();
+    info.flag_ptr = flag.flag_ptr();
+    flags.push_back(info);
+  }
+
+  vector<CommandLineFlagInfo> flags;
+};
+
+TEST(VisitAllFlagsTest, SeesWhatGetAllFlagsReturns) {
+  FLAGS_test_int32 = 119;
+  SetCommandLineOptionWithMode("test_string", "new default",
+                               SET_FLAGS_DEFAULT);
+  vector<CommandLineFlagInfo> expected;
+  GetAllFlags(&expected);
+  FlagCopier copier;
+  VisitAllFlags(&copier);
+  EXPECT_EQ(expected.size(), copier.flags.size());
+  for (size_t i = 0; i < expected.size() && i < copier.flags.size(); ++i) {
+    const CommandLineFlagInfo& info = copier.flags[i];
+    EXPECT_EQ(expected[i].name, info.name);
+    EXPECT_EQ(expected[i].type, info.type);
+    EXPECT_EQ(expected[i].description, info.description);
+    EXPECT_EQ(expected[i].current_value, info.current_value);
+    EXPECT_EQ(expected[i].default_value, info.default_value);
+    EXPECT_EQ(expected[i].filename, info.filename);
+    EXPECT_EQ(expected[i].has_validator_fn, info.has_validator_fn);
+    EXPECT_EQ(expected[i].is_default, info.is_default);
+    EXPECT_EQ(expected[i].flag_ptr, info.flag_ptr);
+  }
+}
+
+TEST(VisitAllFlagsTest, DirectAssignmentIsSticky) {
+  FLAGS_test_int64 = 119;
+  FlagCopier copier;
+  VisitAllFlags(&copier);
+  FLAGS_test_int64 = -2;    // back to the default value
+  EXPECT_FALSE(GetCommandLineFlagInfoOrDie("test_int64").is_default);
+}
+
 TEST(ShowUsageWithFlagsTest, BaseTest) {
   // TODO(csilvers): test this by allowing output other than to stdout.
   // Not urgent since this functionality is tested via
@@ -1002,6 +1283,43 @@ TEST(GetCommandLineOptionTest, NameDoesNotExist) {
   EXPECT_EQ("will not be changed", value);
 }
 
+TEST(GetCommandLineOptionTest, AppendValue) {
+  FLAGS_test_int64 = -1234567890;
+  FLAGS_test_string = "text";
+  string value("values:");
+  EXPECT_TRUE(AppendCommandLineOption("test_int64", &value));
+  EXPECT_TRUE(AppendCommandLineOption("test_string", &value));
+  EXPECT_FALSE(AppendCommandLineOption("test_int3210", &value));
+  EXPECT_EQ("values:-1234567890text", value);
+  FLAGS_test_int64 = -2;
+  FLAGS_test_string = "initial";
+}
+
+// Tests that doubles are printed in as few digits as read back exactly
+TEST(GetCommandLineOptionTest, ShortestDoubles) {
+  static const struct {
+    double value;
+    const char* text;
+  } kDoubles[] = {
+    { 0.0, "0" }, { -0.0, "-0" }, { 1.0, "1" }, { -2.5, "-2.5" },
+    { 0.1, "0.1" }, { 0.3, "0.3" }, { 0.1 + 0.2, "0.30000000000000004" },
+    { 1.0 / 3, "0.3333333333333333" }, { 100.0, "100" },
+    { 1e16, "10000000000000000" }, { 1e17, "1e+17" }, { 1e22, "1e+22" },
+    { 123456.789, "123456.789" }, { 0.0001, "0.0001" }, { 1e-5, "1e-05" },
+    { 1.5e-7, "1.5e-07" }, { 1e-300, "1e-300" }, { 5e300, "5e+300" },
+    { 1.7976931348623157e308, "1.7976931348623157e+308" },
+    { 9007199254740993.0, "9007199254740992" },
+  };
+  for (size_t i = 0; i < arraysize(kDoubles); ++i) {
+    FLAGS_test_double = kDoubles[i].value;
+    string value;
+    EXPECT_TRUE(GetCommandLineOption("test_double", &value));
+    EXPECT_EQ(kDoubles[i].text, value);
+    EXPECT_EQ(kDoubles[i].value, strtod(value.c_str(), NULL));
+  }
+  FLAGS_test_double = -1.0;
+}
+
 TEST(GetCommandLineFlagInfoTest, FlagExists) {
   CommandLineFlagInfo info;
   bool r = GetCommandLineFlagInfo("test_int32", &info);
@@ -1181,6 +1499,208 @@ TEST(DeprecatedFunctionsTest, ReadFromFlagsFileFailure) {
   EXPECT_EQ(-22, FLAGS_test_int32);   // the -21 from the flagsfile didn't take
 }
 
+TEST(DeprecatedFunctionsTest, ReadFromFlagsFileWithoutTrailingNewline) {
+  string filename(TmpFile("flagfile4"));
+  FILE* fp;
+  EXPECT_EQ(0, SafeFOpen(&fp, filename.c_str(), "w"));
+  EXPECT_TRUE(fp != NULL);
+  // The value ends right where the file does.
+  fprintf(fp, "--test_int32=-23");
+  fclose(fp);
+
+  FLAGS_test_int32 = -24;
+  EXPECT_TRUE(ReadFromFlagsFile(filename, GetArgv0(), true));
+  EXPECT_EQ(-23, FLAGS_test_int32);
+}
+
+TEST(DeprecatedFunctionsTest, ReadFromEmptyFlagsFile) {
+  string filename(TmpFile("flagfile5"));
+  FILE* fp;
+  EXPECT_EQ(0, SafeFOpen(&fp, filename.c_str(), "w"));
+  EXPECT_TRUE(fp != NULL);
+  fclose(fp);
+
+  FLAGS_test_int32 = -25;
+  EXPECT_TRUE(ReadFromFlagsFile(filename, GetArgv0(), true));
+  EXPECT_EQ(-25, FLAGS_test_int32);
+}
+
+static void WriteFlagfile(const string& filename, const string& contents) {
+  FILE* fp;
+  EXPECT_EQ(0, SafeFOpen(&fp, filename.c_str(), "w"));
+  EXPECT_TRUE(fp != NULL);
+  fputs(contents.c_str(), fp);
+  fclose(fp);
+}
+
+// Reads nested flagfiles with and without prefetching, which must make
+// no difference to the order in which flags are set.
+static void TestNestedFlagfiles(bool prefetch) {
+  FlagSaver fs;
+  const string a = TmpFile("nested_a"), b = TmpFile("nested_b"),
+               c = TmpFile("nested_c"), d = TmpFile("nested_d");
+  WriteFlagfile(a, "--test_int32=1\n"
+                   "--flagfile=" + b + "\n"
+                   "--test_int64=3\n"
+                   "--test_string=a\n"
+                   "not_our_program\n"
+                   "--flagfile=" + TmpFile("nested_missing") + "\n");
+  WriteFlagfile(b, "--test_int32=2\n"
+                   "--test_int64=2\n"
+                   "--test_string=b\n"
+                   "--flagfile=" + c + "\n");
+  WriteFlagfile(c, "--test_string=c\n");
+  WriteFlagfile(d, "--test_int64=4\n");
+
+  SetFlagfilePrefetching(prefetch);
+  EXPECT_TRUE(ReadFromFlagsFile(a, GetArgv0(), true));
+  EXPECT_EQ(2, FLAGS_test_int32);
+  EXPECT_EQ(3, FLAGS_test_int64);
+  EXPECT_EQ("a", FLAGS_test_string);
+
+  FLAGS_test_string = "unset";
+  EXPECT_FALSE(SetCommandLineOption("flagfile", (d + "," + a).c_str()).empty());
+  EXPECT_EQ(3, FLAGS_test_int64);
+  EXPECT_EQ("a", FLAGS_test_string);
+  EXPECT_FALSE(SetCommandLineOption("flagfile", (a + "," + d).c_str()).empty());
+  EXPECT_EQ(4, FLAGS_test_int64);
+  SetFlagfilePrefetching(false);
+}
+
+TEST(FlagFileTest, NestedFlagfiles) {
+  TestNestedFlagfiles(false);
+}
+
+TEST(FlagFileTest, NestedFlagfilesPrefetched) {
+  TestNestedFlagfiles(true);
+}
+
+#if defined(HAVE_SYS_STAT_H) && !defined(OS_WINDOWS)
+// Flagfiles that nobody may write are mapped into memory rather than read.
+TEST(FlagFileTest, ReadOnlyFlagfiles) {
+  FlagSaver fs;
+  const string a = TmpFile("read_only_a"), b = TmpFile("read_only_b");
+  WriteFlagfile(a, "--test_int32=5\n"
+                   "--flagfile=" + b + "\n");
+  WriteFlagfile(b, "--test_string=read only");
+  EXPECT_EQ(0, chmod(a.c_str(), 0444));
+  EXPECT_EQ(0, chmod(b.c_str(), 0444));
+  for (int prefetch = 0; prefetch < 2; ++prefetch) {
+    FLAGS_test_int32 = 0;
+    FLAGS_test_string = "unset";
+    SetFlagfilePrefetching(prefetch != 0);
+    EXPECT_TRUE(ReadFromFlagsFile(a, GetArgv0(), true));
+    EXPECT_EQ(5, FLAGS_test_int32);
+    EXPECT_EQ("read only", FLAGS_test_string);
+  }
+  SetFlagfilePrefetching(false);
+  EXPECT_EQ(0, chmod(a.c_str(), 0644));
+  EXPECT_EQ(0, chmod(b.c_str(), 0644));
+}
+#endif
+
+TEST(FlagFileTest, CompileFlagfile) {
+  FlagSaver fs;
+  const string text = TmpFile("compiled_text");
+  const string binary = TmpFile("compiled_binary");
+  const string nested = TmpFile("compiled_nested");
+  WriteFlagfile(nested, "--test_uint64=0x10\n");
+  WriteFlagfile(text, "# a comment\n"
+                      "--test_bool\n"
+                      "--test_int32=-5\n"
+                      "-test_uint32=7\n"
+                      "--test_int64=0x10000000000\n"
+                      "--test_double=1.5\n"
+                      "--test_string=hello world\n"
+                      "--test-str1=dashes\n"
+                      "--nounused_bool\n"
+                      "--flagfile=" + nested + "\n"
+                      "\n"
+                      "not_our_program\n"
+                      "--test_int32=100\n"
+                      "--test_str2=skipped\n"
+                      + string(ProgramInvocationShortName()) + "\n"
+                      "--test_str3=applied\n"
+                      "--test_double=2\n");
+  EXPECT_TRUE(CompileFlagfile(text, binary));
+  // Binary flagfiles can't be compiled again.
+  EXPECT_FALSE(CompileFlagfile(binary, TmpFile("compiled_twice")));
+
+  EXPECT_TRUE(ReadFromFlagsFile(binary, GetArgv0(), false));
+  EXPECT_TRUE(FLAGS_test_bool);
+  EXPECT_EQ(-5, FLAGS_test_int32);
+  EXPECT_EQ(7, FLAGS_test_uint32);
+  EXPECT_EQ(static_cast<int64>(1) << 40, FLAGS_test_int64);
+  EXPECT_EQ(16, FLAGS_test_uint64);
+  EXPECT_EQ(2.0, FLAGS_test_double);
+  EXPECT_EQ("hello world", FLAGS_test_string);
+  EXPECT_EQ("dashes", FLAGS_test_str1);
+  EXPECT_EQ("initial", FLAGS_test_str2);
+  EXPECT_EQ("applied", FLAGS_test_str3);
+  EXPECT_FALSE(FLAGS_unused_bool);
+
+  // Values which are invalid for their flag are errors, like in text.
+  WriteFlagfile(text, "--test_int32=7\n"
+                      "--test_uint32=-1\n");
+  EXPECT_TRUE(CompileFlagfile(text, binary));
+  EXPECT_FALSE(ReadFromFlagsFile(binary, GetArgv0(), false));
+  EXPECT_EQ(-5, FLAGS_test_int32);
+  EXPECT_EQ(7, FLAGS_test_uint32);
+}
+
+TEST(FlagFileTest, ReadFromTruncatedBinaryFlagfile) {
+  FlagSaver fs;
+  const string text = TmpFile("truncated_text");
+  const string binary = TmpFile("truncated_binary");
+  WriteFlagfile(text, "--test_int32=7\n");
+  EXPECT_TRUE(CompileFlagfile(text, binary));
+
+  FILE* fp;
+  EXPECT_EQ(0, SafeFOpen(&fp, binary.c_str(), "rb"));
+  char contents[1024];
+  const size_t size = fread(contents, 1, sizeof(contents), fp);
+  fclose(fp);
+  EXPECT_LT(16u, size);
+  FLAGS_test_int32 = -1;
+  EXPECT_FALSE(ReadFlagsFromBuffer(contents, size - 1, false));
+  EXPECT_FALSE(ReadFlagsFromBuffer(contents, 16, false));
+  EXPECT_EQ(-1, FLAGS_test_int32);
+  EXPECT_TRUE(ReadFlagsFromBuffer(contents, size, false));
+  EXPECT_EQ(7, FLAGS_test_int32);
+}
+
+// A NUL inside the text of a record would let the reader compare names
+// and values past their end, so such files are rejected as corrupt.
+TEST(FlagFileTest, ReadFromCorruptBinaryFlagfile) {
+  FlagSaver fs;
+  const string text = TmpFile("corrupt_text");
+  const string binary = TmpFile("corrupt_binary");
+  WriteFlagfile(text, "--test_string=abcdef\n");
+  EXPECT_TRUE(CompileFlagfile(text, binary));
+
+  FILE* fp;
+  EXPECT_EQ(0, SafeFOpen(&fp, binary.c_str(), "rb"));
+  char buffer[1024];
+  const size_t size = fread(buffer, 1, sizeof(buffer), fp);
+  fclose(fp);
+  const string contents(buffer, size);
+  const size_t name = contents.find("test_string");
+  const size_t value = contents.find("abcdef");
+  EXPECT_NE(string::npos, name);
+  EXPECT_NE(string::npos, value);
+
+  FLAGS_test_string = "unchanged";
+  string corrupt = contents;
+  corrupt[value + 2] = '\0';
+  EXPECT_FALSE(ReadFlagsFromBuffer(corrupt.data(), corrupt.size(), false));
+  corrupt = contents;
+  corrupt[name + 2] = '\0';
+  EXPECT_FALSE(ReadFlagsFromBuffer(corrupt.data(), corrupt.size(), false));
+  EXPECT_EQ("unchanged", FLAGS_test_string);
+  EXPECT_TRUE(ReadFlagsFromBuffer(contents.data(), contents.size(), false));
+  EXPECT_EQ("abcdef", FLAGS_test_string);
+}
+
 TEST(FlagsSetBeforeInitTest, TryFromEnv) {
   EXPECT_EQ("pre-set", FLAGS_test_tryfromenv);
 }
@@ -1315,6 +1835,106 @@ TEST(ParseCommandLineFlagsAndDashArgs, OneDashArg) {
   EXPECT_EQ(0, ParseTestFlag(false, arraysize(argv) - 1, argv));
 }
 
+TEST(ParseCommandLineFlagsAndDashArgs, DashesInFlagName) {
+  const char* argv[] = {
+    "my_test",
+    "--test-flag=5",
+    NULL,
+  };
+
+  EXPECT_EQ(5, ParseTestFlag(true, arraysize(argv) - 1, argv));
+  EXPECT_EQ(5, ParseTestFlag(false, arraysize(argv) - 1, argv));
+}
+
+TEST(ParseCommandLineFlagsAndDashArgs, DashesInFlagNameWithSeparateValue) {
+  const char* argv[] = {
+    "my_test",
+    "-test-flag",
+    "6",
+    NULL,
+  };
+
+  EXPECT_EQ(6, ParseTestFlag(true, arraysize(argv) - 1, argv));
+  EXPECT_EQ(6, ParseTestFlag(false, arraysize(argv) - 1, argv));
+}
+
+// Non-options move behind the options in their original order, but
+// still after whatever follows "--".
+TEST(ParseCommandLineFlagsAndDashArgs, NonOptionsMoveToTheEnd) {
+  const char* const_argv[] = {
+    "my_test", "a", "--test_flag", "8", "b", "-", "--test_bool", "--",
+    "c", "--test_flag=9", NULL,
+  };
+  const char* const kPermuted[] = {
+    "my_test", "--test_flag", "8", "--test_bool", "--",
+    "c", "--test_flag=9", "a", "b", "-",
+  };
+  for (int remove_flags = 0; remove_flags <= 1; ++remove_flags) {
+    FlagSaver fs;
+    int argc = arraysize(const_argv) - 1;
+    char* argv_save[arraysize(const_argv)];
+    memcpy(argv_save, const_argv, sizeof(argv_save));
+    char** argv = argv_save;
+    const uint32 first_nonopt = ParseCommandLineNonHelpFlags(
+        &argc, &argv, remove_flags != 0);
+    EXPECT_EQ(8, FLAGS_test_flag);
+    EXPECT_TRUE(FLAGS_test_bool);
+    if (remove_flags) {
+      EXPECT_EQ(1, first_nonopt);
+      EXPECT_EQ(6, argc);
+      EXPECT_STREQ("my_test", argv[0]);
+      for (int i = 1; i < argc; ++i)
+        EXPECT_STREQ(kPermuted[i + 4], argv[i]);
+    } else {
+      EXPECT_EQ(5, first_nonopt);
+      EXPECT_EQ(10, argc);
+      for (int i = 0; i < argc; ++i)
+        EXPECT_STREQ(kPermuted[i], argv[i]);
+    }
+  }
+}
+
+DEFINE_int32(test_deduplicated, 0, "set many times by the deduplication test");
+
+static int num_deduplicated_validations = 0;
+
+static bool CountDeduplicatedValidation(const char*, int32 value) {
+  ++num_deduplicated_validations;
+  return value >= 0;
+}
+
+// With deduplication, only the last value assigned to a flag is parsed
+// and validated, so the invalid ones before it do no harm.
+TEST(ParseCommandLineFlagsDeduplicationTest, LastValueWins) {
+  const string flagfile = TmpFile("deduplicated");
+  WriteFlagfile(flagfile, "--test_deduplicated=1\n"
+                          "--test_int32=5\n"
+                          "--test_deduplicated=not a number\n");
+  const string flagfile_flag = "--flagfile=" + flagfile;
+  const char* const_argv[] = {
+    "my_test", "--test_deduplicated=-1", flagfile_flag.c_str(),
+    "--test_int32", "6", "--test_deduplicated=3", NULL,
+  };
+  EXPECT_TRUE(RegisterFlagValidator(&FLAGS_test_deduplicated,
+                                    &CountDeduplicatedValidation));
+  num_deduplicated_validations = 0;
+  const uint64 num_skipped = GetNumSkippedFlagAssignments();
+
+  SetFlagAssignmentDeduplication(true);
+  int argc = arraysize(const_argv) - 1;
+  char* argv_save[arraysize(const_argv)];
+  memcpy(argv_save, const_argv, sizeof(argv_save));
+  char** argv = argv_save;
+  ParseCommandLineNonHelpFlags(&argc, &argv, true);
+  SetFlagAssignmentDeduplication(false);
+
+  EXPECT_EQ(3, FLAGS_test_deduplicated);
+  EXPECT_EQ(6, FLAGS_test_int32);
+  EXPECT_EQ(1, num_deduplicated_validations);
+  EXPECT_EQ(num_skipped + 4, GetNumSkippedFlagAssignments());
+  EXPECT_TRUE(RegisterFlagValidator(&FLAGS_test_deduplicated, NULL));
+}
+
 #ifdef GTEST_HAS_DEATH_TEST
 TEST(ParseCommandLineFlagsUnknownFlagDeathTest,
      FlagIsCompletelyUnknown) {
@@ -1470,6 +2090,42 @@ TEST(FlagsValidatorDeathTest, InvalidFlagNeverSet) {
 }
 #endif
 
+#ifdef GTEST_HAS_DEATH_TEST
+TEST(FlagsValidatorDeathTest, InvalidFlagNeverSetAfterFlagSaver) {
+  // A validator which a FlagSaver gives back is checked at argv-parse
+  // time just like one that was never taken away.
+  const char* argv[] = {
+    "my_test",
+    NULL,
+  };
+  EXPECT_TRUE(RegisterFlagValidator(&FLAGS_test_flag, &ValidateTestFlagIs5));
+  {
+    FlagSaver fs;
+    EXPECT_TRUE(RegisterFlagValidator(&FLAGS_test_flag, NULL));
+    EXPECT_EQ(-1, ParseTestFlag(true, arraysize(argv) - 1, argv));
+  }
+  EXPECT_DEATH(ParseTestFlag(true, arraysize(argv) - 1, argv),
+               "ERROR: --test_flag must be set on the commandline");
+}
+#endif
+
+#ifdef GTEST_HAS_DEATH_TEST
+TEST(FlagsValidatorDeathTest, ValidateInParallel) {
+  const char* argv[] = {
+    "my_test",
+    NULL,
+  };
+  SetParallelFlagValidation(true);
+  EXPECT_TRUE(RegisterFlagValidator(&FLAGS_test_flag, &ValidateTestFlagIs5));
+  EXPECT_DEATH(ParseTestFlag(true, arraysize(argv) - 1, argv),
+               "ERROR: --test_flag must be set on the commandline");
+  EXPECT_NE("", SetCommandLineOptionWithMode("test_flag", "5",
+                                             SET_FLAGS_DEFAULT));
+  EXPECT_EQ(5, ParseTestFlag(true, arraysize(argv) - 1, argv));
+  SetParallelFlagValidation(false);
+}
+#endif
+
 TEST(FlagsValidator, InvalidFlagPtr) {
   int32 dummy;
   EXPECT_FALSE(RegisterFlagValidator(NULL, &ValidateTestFlagIs5));
@@ -1518,6 +2174,139 @@ TEST(FlagsValidator, FlagSaver) {
   EXPECT_EQ("", SetCommandLineOption("test_flag", "50"));  // validator is back
 }
 
+static CommandLineOptionUpdate MakeUpdate(const char* name, const char* value,
+                                          FlagSettingMode set_mode) {
+  CommandLineOptionUpdate update;
+  update.name = name;
+  update.value = value;
+  update.set_mode = set_mode;
+  return update;
+}
+
+TEST(SetCommandLineOptionsTest, AllChangesMade) {
+  vector<CommandLineOptionUpdate> updates;
+  updates.push_back(MakeUpdate("test_int32", "5", SET_FLAGS_VALUE));
+  updates.push_back(MakeUpdate("test_string", "new default",
+                               SET_FLAGS_DEFAULT));
+  updates.push_back(MakeUpdate("test_int32", "6", SET_FLAG_IF_DEFAULT));
+  EXPECT_TRUE(SetCommandLineOptions(&updates));
+  EXPECT_EQ(5, FLAGS_test_int32);
+  EXPECT_EQ("new default", FLAGS_test_string);
+  EXPECT_EQ("new default",
+            GetCommandLineFlagInfoOrDie("test_string").default_value);
+  EXPECT_EQ("test_int32 set to 5\n", updates[0].result);
+  EXPECT_EQ("test_string set to new default\n", updates[1].result);
+  EXPECT_EQ("test_int32 set to 5", updates[2].result);   // already set
+  for (size_t i = 0; i < updates.size(); ++i)
+    EXPECT_EQ("", updates[i].error);
+}
+
+TEST(SetCommandLineOptionsTest, NoChangeIfValueIsBad) {
+  vector<CommandLineOptionUpdate> updates;
+  updates.push_back(MakeUpdate("test_int32", "5", SET_FLAGS_VALUE));
+  updates.push_back(MakeUpdate("test_double", "illegal", SET_FLAGS_VALUE));
+  updates.push_back(MakeUpdate("no_such_flag", "1", SET_FLAGS_VALUE));
+  updates.push_back(MakeUpdate("flagfile", "/dev/null", SET_FLAGS_VALUE));
+  EXPECT_FALSE(SetCommandLineOptions(&updates));
+  EXPECT_EQ(-1, FLAGS_test_int32);
+  EXPECT_EQ("", updates[0].result);
+  EXPECT_EQ("", updates[0].error);
+  EXPECT_NE(string::npos, updates[1].error.find("illegal value 'illegal'"));
+  EXPECT_NE(string::npos, updates[2].error.find("unknown command line flag"));
+  EXPECT_NE(string::npos, updates[3].error.find("'flagfile'"));
+}
+
+TEST(SetCommandLineOptionsTest, NoChangeIfValueFailsValidation) {
+  EXPECT_TRUE(RegisterFlagValidator(&FLAGS_test_flag, &ValidateTestFlagIs5));
+  vector<CommandLineOptionUpdate> updates;
+  updates.push_back(MakeUpdate("test_int32", "7", SET_FLAGS_VALUE));
+  updates.push_back(MakeUpdate("test_string", "new default",
+                               SET_FLAGS_DEFAULT));
+  updates.push_back(MakeUpdate("test_flag", "5", SET_FLAGS_VALUE));
+  updates.push_back(MakeUpdate("test_flag", "50", SET_FLAGS_VALUE));
+  EXPECT_FALSE(SetCommandLineOptions(&updates));
+  EXPECT_EQ(-1, FLAGS_test_int32);
+  EXPECT_EQ("initial", FLAGS_test_string);
+  EXPECT_EQ(-1, FLAGS_test_flag);
+  EXPECT_TRUE(GetCommandLineFlagInfoOrDie("test_int32").is_default);
+  EXPECT_EQ("initial",
+            GetCommandLineFlagInfoOrDie("test_string").default_value);
+  EXPECT_EQ("", updates[2].error);
+  EXPECT_NE(string::npos, updates[3].error.find("failed validation"));
+  for (size_t i = 0; i < updates.size(); ++i)
+    EXPECT_EQ("", updates[i].result);
+  EXPECT_TRUE(RegisterFlagValidator(&FLAGS_test_flag, NULL));
+}
+
+TEST(FlagHandleTest, FindsFlagByNameAndByPointer) {
+  FlagHandle by_name("test_int64");
+  FlagHandle by_ptr(&FLAGS_test_int64);
+  EXPECT_TRUE(by_name.valid());
+  EXPECT_TRUE(by_ptr.valid());
+  EXPECT_EQ(string("test_int64"), by_name.name());
+  EXPECT_EQ(string("test_int64"), by_ptr.name());
+
+  FlagHandle missing("no_such_flag");
+  EXPECT_FALSE(missing.valid());
+  EXPECT_TRUE(missing.name() == NULL);
+  int32 value = 7;
+  string string_value = "unchanged";
+  EXPECT_FALSE(missing.Get(&value));
+  EXPECT_FALSE(missing.Set(value));
+  EXPECT_FALSE(missing.GetAsString(&string_value));
+  EXPECT_EQ("", missing.SetFromString("1"));
+  EXPECT_EQ(7, value);
+  EXPECT_EQ("unchanged", string_value);
+}
+
+TEST(FlagHandleTest, GetsAndSetsTypedValues) {
+  FlagHandle int64_flag("test_int64");
+  GFLAGS_NAMESPACE::int64 value = 0;
+  EXPECT_TRUE(int64_flag.Get(&value));
+  EXPECT_EQ(-2, value);
+  EXPECT_TRUE(int64_flag.Set(GFLAGS_NAMESPACE::int64(1) << 40));
+  EXPECT_EQ(GFLAGS_NAMESPACE::int64(1) << 40, FLAGS_test_int64);
+  EXPECT_FALSE(GetCommandLineFlagInfoOrDie("test_int64").is_default);
+
+  // Only the exact type of the flag will do.
+  int32 int32_value = 3;
+  EXPECT_FALSE(int64_flag.Get(&int32_value));
+  EXPECT_FALSE(int64_flag.Set(int32_value));
+  EXPECT_EQ(3, int32_value);
+
+  FlagHandle string_flag(&FLAGS_test_string);
+  EXPECT_TRUE(string_flag.Set(string("handled"), SET_FLAGS_DEFAULT));
+  EXPECT_EQ("handled", FLAGS_test_string);
+  EXPECT_EQ("handled",
+            GetCommandLineFlagInfoOrDie("test_string").default_value);
+  string string_value;
+  EXPECT_TRUE(string_flag.Get(&string_value));
+  EXPECT_EQ("handled", string_value);
+
+  EXPECT_FALSE(FlagHandle("flagfile").Set(string("/no/such/flagfile")));
+}
+
+TEST(FlagHandleTest, GetsAndSetsStrings) {
+  FlagHandle handle("test_double");
+  EXPECT_EQ("test_double set to 2.5\n", handle.SetFromString("2.5"));
+  EXPECT_EQ(2.5, FLAGS_test_double);
+  string value;
+  EXPECT_TRUE(handle.GetAsString(&value));
+  EXPECT_EQ("2.5", value);
+  EXPECT_EQ("", handle.SetFromString("illegal"));
+  EXPECT_EQ(2.5, FLAGS_test_double);
+}
+
+TEST(FlagHandleTest, SetFailsValidation) {
+  EXPECT_TRUE(RegisterFlagValidator(&FLAGS_test_flag, &ValidateTestFlagIs5));
+  FlagHandle handle(&FLAGS_test_flag);
+  EXPECT_FALSE(handle.Set(int32(50)));
+  EXPECT_EQ(-1, FLAGS_test_flag);
+  EXPECT_TRUE(handle.Set(int32(5)));
+  EXPECT_EQ(5, FLAGS_test_flag);
+  EXPECT_TRUE(RegisterFlagValidator(&FLAGS_test_flag, NULL));
+}
+
 
 }  // unnamed namespace
 